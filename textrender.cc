@@ -55,8 +55,20 @@
 #include "ncbind/ncbind.hpp"
 
 #include "DebugIntf.h"
-
+#include "StorageIntf.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
 
 #if 0
 #define dbg_print TVPAddLog
@@ -68,7 +80,8 @@
 #include "FontRasterizer.h"
 FontRasterizer *GetCurrentRasterizer();
 
-using RgbColor = uint32_t;
+using RgbColor  = uint32_t;
+using Codepoint = uint32_t; // Unicode のコードポイント (サロゲートペアは結合済み)
 
 #define setprop_t(d, p, ty)                                                    \
   {                                                                            \
@@ -137,6 +150,113 @@ using RgbColor = uint32_t;
     }                                                                          \
   }
 
+/**
+ * @brief Little-endian binary encoder for layout traces and snapshots.
+ */
+class TextRenderWriter {
+public:
+  void u8(uint8_t v) { m_data.push_back(v); }
+
+  void u32(uint32_t v) {
+    for (int i = 0; i < 4; ++i) {
+      m_data.push_back(static_cast<uint8_t>(v >> (i * 8)));
+    }
+  }
+
+  void i32(int32_t v) { u32(static_cast<uint32_t>(v)); }
+
+  void u16(uint16_t v) {
+    m_data.push_back(static_cast<uint8_t>(v));
+    m_data.push_back(static_cast<uint8_t>(v >> 8));
+  }
+
+  void str(tjs_string const &s) {
+    u32(static_cast<uint32_t>(s.size()));
+    for (auto c : s) {
+      m_data.push_back(static_cast<uint8_t>(c));
+      m_data.push_back(static_cast<uint8_t>(c >> 8));
+    }
+  }
+
+  std::vector<uint8_t> const &data() const { return m_data; }
+
+  void save(ttstr const &path) const {
+    auto stream = TVPCreateStream(path, TJS_BS_WRITE);
+    stream->WriteBuffer(m_data.data(), static_cast<tjs_uint>(m_data.size()));
+    delete stream;
+  }
+
+private:
+  std::vector<uint8_t> m_data{};
+};
+
+/**
+ * @brief Decoder for the data written by TextRenderWriter.
+ */
+class TextRenderReader {
+public:
+  TextRenderReader(uint8_t const *data, size_t size)
+      : m_data(data), m_size(size) {}
+
+  bool eof() const { return m_pos >= m_size; }
+
+  uint8_t u8() {
+    require(1);
+    return m_data[m_pos++];
+  }
+
+  uint32_t u32() {
+    require(4);
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) {
+      v |= static_cast<uint32_t>(m_data[m_pos++]) << (i * 8);
+    }
+    return v;
+  }
+
+  int32_t i32() { return static_cast<int32_t>(u32()); }
+
+  // 要素数を読む．破損したデータで巨大な領域を確保しないよう，各要素が
+  // 少なくとも recordSize バイトあるものとして残りの大きさと照合する
+  uint32_t count(size_t recordSize) {
+    auto n = u32();
+    require(size_t(n) * recordSize);
+    return n;
+  }
+
+  tjs_string str() {
+    auto len = u32();
+    require(size_t(len) * 2);
+
+    tjs_string s(len, 0);
+    for (auto &c : s) {
+      c = static_cast<tjs_char>(m_data[m_pos] | (m_data[m_pos + 1] << 8));
+      m_pos += 2;
+    }
+    return s;
+  }
+
+  static std::vector<uint8_t> load(ttstr const &path) {
+    auto stream = TVPCreateStream(path, TJS_BS_READ);
+    std::vector<uint8_t> data(static_cast<size_t>(stream->GetSize()));
+    stream->ReadBuffer(data.data(), static_cast<tjs_uint>(data.size()));
+    delete stream;
+    return data;
+  }
+
+private:
+  uint8_t const *m_data;
+  size_t         m_size;
+  size_t         m_pos = 0;
+
+  void require(size_t n) {
+    if (m_size - m_pos < n || m_pos > m_size) {
+      TVPThrowExceptionMessage(
+          TJS_W("TextRenderReader: unexpected end of data"));
+    }
+  }
+};
+
 struct TextRenderState {
   bool       bold        = false;         // 太字
   bool       italic      = false;         // 斜体
@@ -153,6 +273,8 @@ struct TextRenderState {
   int        pitch       = 0;             // 字間
   int        lineSize    = 0;             // ラインの高さ
 
+  bool operator==(TextRenderState const &) const = default;
+
   // -------------------------------------------------------------- //
 
   tTJSVariant serialize() const {
@@ -206,8 +328,78 @@ struct TextRenderState {
     state.deserialize(t);
     return state;
   }
+
+  void write(TextRenderWriter &w) const {
+    w.u8(bold);
+    w.u8(italic);
+    w.str(face);
+    w.i32(fontSize);
+    w.u32(chColor);
+    w.i32(rubySize);
+    w.i32(rubyOffset);
+    w.u8(shadow);
+    w.u32(shadowColor);
+    w.u8(edge);
+    w.u32(edgeColor);
+    w.i32(lineSpacing);
+    w.i32(pitch);
+    w.i32(lineSize);
+  }
+
+  void read(TextRenderReader &r) {
+    bold        = r.u8();
+    italic      = r.u8();
+    face        = r.str();
+    fontSize    = r.i32();
+    chColor     = r.u32();
+    rubySize    = r.i32();
+    rubyOffset  = r.i32();
+    shadow      = r.u8();
+    shadowColor = r.u32();
+    edge        = r.u8();
+    edgeColor   = r.u32();
+    lineSpacing = r.i32();
+    pitch       = r.i32();
+    lineSize    = r.i32();
+  }
 };
 
+// UTF-16 の符号化・復号
+
+static constexpr Codepoint kReplacementCharacter = 0xFFFD;
+
+static bool is_surrogate(tjs_char ch) { return (ch & 0xF800) == 0xD800; }
+
+// str[i] から 1 文字を復号し，i を最後に読んだ位置に進める．
+// 対になっていないサロゲートは U+FFFD とする
+static Codepoint decode_surrogate(tjs_char const *str, size_t len,
+                                  size_t &i) {
+  auto hi = str[i];
+
+  if (hi <= 0xDBFF && i + 1 < len && 0xDC00 <= str[i + 1] &&
+      str[i + 1] <= 0xDFFF) {
+    auto lo = str[++i];
+    return 0x10000 + ((Codepoint(hi - 0xD800) << 10) | (lo - 0xDC00));
+  }
+
+  return kReplacementCharacter;
+}
+
+static Codepoint decode_codepoint(tjs_char const *str, size_t len, size_t &i) {
+  // BMP の文字はそのまま返す
+  return is_surrogate(str[i]) ? decode_surrogate(str, len, i) : str[i];
+}
+
+static void append_codepoint(tjs_string &str, Codepoint cp) {
+  if (cp < 0x10000) {
+    str += static_cast<tjs_char>(cp);
+  } else {
+    cp -= 0x10000;
+    str += static_cast<tjs_char>(0xD800 | (cp >> 10));
+    str += static_cast<tjs_char>(0xDC00 | (cp & 0x3FF));
+  }
+}
+
 struct TextRenderOptions {
   tjs_string following = TJS_W(
       "%),:;]}｡｣ﾞﾟ。，、．：；゛゜ヽヾゝゞ々’”）〕］｝〉》」』】°′″℃￠％‰　!.?"
@@ -215,6 +407,43 @@ struct TextRenderOptions {
   tjs_string leading = TJS_W("\\$([{｢‘“（〔［｛〈《「『【￥＄￡");
   tjs_string begin = TJS_W("「『（‘“〔［｛〈《");
   tjs_string end   = TJS_W("」』）’”〕］｝〉》");
+  bool       wordWrap = false; // 欧文を単語単位で折り返す
+
+  // タブ位置 (行頭からの距離，昇順)．最後の位置より後ろは tabWidth ごと
+  std::vector<int> tabStops{};
+  int              tabWidth = 0; // 0 ならその書式の空白 4 個分
+
+  // 文字の分類 (文字ごとに文字列を検索しないよう表にしておく)
+  enum : uint8_t {
+    kLeading   = 1 << 0,
+    kFollowing = 1 << 1,
+    kBegin     = 1 << 2,
+    kEnd       = 1 << 3,
+  };
+
+  std::unordered_map<Codepoint, uint8_t> classes{};
+
+  TextRenderOptions() { updateClasses(); }
+
+  uint8_t classOf(Codepoint ch) const {
+    auto it = classes.find(ch);
+    return it != classes.end() ? it->second : 0;
+  }
+
+  void updateClasses() {
+    classes.clear();
+
+    auto add = [this](tjs_string const &chars, uint8_t cls) {
+      for (size_t i = 0, len = chars.size(); i < len; ++i) {
+        classes[decode_codepoint(chars.data(), len, i)] |= cls;
+      }
+    };
+
+    add(leading, kLeading);
+    add(following, kFollowing);
+    add(begin, kBegin);
+    add(end, kEnd);
+  }
 
   // -------------------------------------------------------------- //
 
@@ -225,6 +454,18 @@ struct TextRenderOptions {
     setprop(dict, leading);
     setprop(dict, begin);
     setprop(dict, end);
+    setprop(dict, wordWrap);
+    setprop(dict, tabWidth);
+
+    auto array = TJSCreateArrayObject();
+    for (size_t i = 0, cnt = tabStops.size(); i < cnt; ++i) {
+      tTJSVariant v(tabStops[i]);
+      array->PropSetByNum(TJS_MEMBERENSURE, i, &v, array);
+    }
+
+    tTJSVariant stops(array, array);
+    array->Release();
+    dict->PropSet(TJS_MEMBERENSURE, TJS_W("tabStops"), nullptr, &stops, dict);
 
     auto res = tTJSVariant(dict, dict);
     dict->Release();
@@ -242,6 +483,59 @@ struct TextRenderOptions {
     getprop_ensure_deref(dict, leading, AsStringNoAddRef());
     getprop_ensure_deref(dict, begin, AsStringNoAddRef());
     getprop_ensure_deref(dict, end, AsStringNoAddRef());
+    getprop(dict, wordWrap);
+    getprop(dict, tabWidth);
+
+    tTJSVariant stops{};
+    if (TJS_SUCCEEDED(dict->PropGet(0, TJS_W("tabStops"), nullptr, &stops,
+                                    dict)) &&
+        stops.Type() == tvtObject) {
+      auto array = stops.AsObjectNoAddRef();
+
+      tTJSVariant countVar{};
+      array->PropGet(0, TJS_W("count"), nullptr, &countVar, array);
+      tjs_int count = countVar;
+
+      tabStops.clear();
+      for (tjs_int i = 0; i < count; ++i) {
+        tTJSVariant v{};
+        array->PropGetByNum(0, i, &v, array);
+        tabStops.push_back(static_cast<tjs_int>(v));
+      }
+
+      std::sort(tabStops.begin(), tabStops.end());
+    }
+
+    updateClasses();
+  }
+
+  void write(TextRenderWriter &w) const {
+    w.str(following);
+    w.str(leading);
+    w.str(begin);
+    w.str(end);
+    w.u8(wordWrap);
+    w.i32(tabWidth);
+    w.u32(static_cast<uint32_t>(tabStops.size()));
+    for (auto stop : tabStops) {
+      w.i32(stop);
+    }
+  }
+
+  void read(TextRenderReader &r) {
+    following = r.str();
+    leading   = r.str();
+    begin     = r.str();
+    end       = r.str();
+    wordWrap  = r.u8();
+    tabWidth  = r.i32();
+
+    tabStops.resize(r.count(4));
+    for (auto &stop : tabStops) {
+      stop = r.i32();
+    }
+
+    updateClasses();
   }
 
   static TextRenderState from(tTJSVariant t) {
@@ -251,6 +545,57 @@ struct TextRenderOptions {
   }
 };
 
+// 縁取り・影によるはみ出し量 (描画側の既定値に合わせる)
+static constexpr int kTextRenderEdgeExtent    = 1;
+static constexpr int kTextRenderShadowOffsetX = 2;
+static constexpr int kTextRenderShadowOffsetY = 2;
+
+struct TextRenderRect {
+  int left   = 0;
+  int top    = 0;
+  int right  = 0; // exclusive
+  int bottom = 0; // exclusive
+
+  bool empty() const { return right <= left || bottom <= top; }
+
+  void unite(TextRenderRect const &r) {
+    if (r.empty()) {
+      return;
+    }
+    if (empty()) {
+      *this = r;
+      return;
+    }
+    left   = std::min(left, r.left);
+    top    = std::min(top, r.top);
+    right  = std::max(right, r.right);
+    bottom = std::max(bottom, r.bottom);
+  }
+
+  int64_t area() const {
+    return empty() ? 0 : int64_t(right - left) * int64_t(bottom - top);
+  }
+
+  // -------------------------------------------------------------- //
+
+  tTJSVariant serialize() const {
+    auto dict = TJSCreateDictionaryObject();
+
+    int width  = right - left;
+    int height = bottom - top;
+
+    setprop(dict, left);
+    setprop(dict, top);
+    setprop(dict, width);
+    setprop(dict, height);
+
+    auto res = tTJSVariant(dict, dict);
+    dict->Release();
+
+    return res;
+  }
+};
+
 struct CharacterInfo {
   bool       bold     = false;         // 太字
   bool       italic   = false;         // 斜体
@@ -269,6 +614,10 @@ struct CharacterInfo {
 
   tjs_string text = TJS_W(""); // 文字
 
+  // 以下はスクリプトには公開しない
+  size_t source = 0; // 入力テキスト中の位置
+  int    line   = 0; // 行番号
+
   // -------------------------------------------------------------- //
 
   tTJSVariant serialize() const {
@@ -290,6 +639,11 @@ struct CharacterInfo {
 
     setprop(dict, text);
 
+    // BMP 外の文字にだけ付ける (通常の文字の辞書は大きくしない)
+    if (bool approximate = this->approximate()) {
+      setprop(dict, approximate);
+    }
+
     auto res = tTJSVariant(dict, dict);
     dict->Release();
 
@@ -324,647 +678,3485 @@ struct CharacterInfo {
     state.deserialize(t);
     return state;
   }
-};
 
-#define property_accessor(name, type, storage)                                 \
-  type get_##name() const { return storage; }                                  \
-  void set_##name(type v) { storage = v; }
+  TextRenderRect bounds() const;
 
-#define property_accessor_cast(name, type, cast, storage)                      \
-  cast get_##name() const { return cast(storage); }                            \
-  void set_##name(cast v) { storage = type(v); }
+  // BMP 外の文字．ラスタライザで測れないので幅は全角の空白で近似している
+  bool approximate() const {
+    return !graph && !text.empty() && is_surrogate(text[0]);
+  }
 
-#define property_accessor_string(name, storage)                                \
-  tTJSVariant get_##name() const { return tTJSVariant(storage); }              \
-  void        set_##name(tTJSVariant v) {                                      \
-    auto s  = v.AsStringNoAddRef();                                     \
-    storage = s->LongString ? s->LongString : s->ShortString;           \
+  void write(TextRenderWriter &w) const {
+    w.u8(bold | (italic << 1) | (graph << 2) | (vertical << 3) |
+         (edge.has_value() << 4) | (shadow.has_value() << 5));
+    w.str(face);
+    w.i32(x);
+    w.i32(y);
+    w.i32(cw);
+    w.i32(size);
+    w.u32(color);
+    w.u32(edge.value_or(0));
+    w.u32(shadow.value_or(0));
+    w.str(text);
+    w.u32(static_cast<uint32_t>(source));
+    w.i32(line);
   }
 
-#define property_delegate(name) NCB_PROPERTY(name, get_##name, set_##name);
+  // write() が書き出す最小の大きさ (文字列が空の場合)
+  static constexpr size_t kMinEncodedSize = 45;
+
+  void read(TextRenderReader &r) {
+    auto flags = r.u8();
+    bold       = flags & 1;
+    italic     = flags & 2;
+    graph      = flags & 4;
+    vertical   = flags & 8;
+    face       = r.str();
+    x          = r.i32();
+    y          = r.i32();
+    cw         = r.i32();
+    size       = r.i32();
+    color      = r.u32();
+
+    auto edgeColor   = r.u32();
+    auto shadowColor = r.u32();
+    edge   = (flags & 16) ? std::make_optional(edgeColor) : std::nullopt;
+    shadow = (flags & 32) ? std::make_optional(shadowColor) : std::nullopt;
+
+    text   = r.str();
+    source = r.u32();
+    line   = r.i32();
+  }
+
+  // 最初に異なるフィールドの名前 (一致すれば nullptr)
+  tjs_char const *diff(CharacterInfo const &o) const {
+#define diff_field(p)                                                          \
+  if (p != o.p)                                                                \
+    return TJS_W(#p);
+
+    diff_field(text);
+    diff_field(x);
+    diff_field(y);
+    diff_field(cw);
+    diff_field(size);
+    diff_field(face);
+    diff_field(bold);
+    diff_field(italic);
+    diff_field(graph);
+    diff_field(vertical);
+    diff_field(color);
+    diff_field(edge);
+    diff_field(shadow);
+#undef diff_field
+
+    return nullptr;
+  }
+};
 
 /**
- * @brief The base of the TextRender class. This only performs the text
- * layouting and the line breaking (禁則処理)．
+ * @brief Buffers trace events and writes them as Chrome trace-event JSON.
+ *
+ * push() never performs I/O: events go to a fixed ring buffer (the oldest
+ * is dropped when it is full) and are written by drain(), which the owner
+ * calls outside of any measured span.
  */
-class TextRenderBase {
+class TextRenderProfiler {
 public:
-  TextRenderBase();
-  virtual ~TextRenderBase();
-  bool        render(tTJSString text, int autoIndent, int diff, int all,
-                     bool _reserved);
-  void        setRenderSize(int width, int height);
-  void        setDefault(tTJSVariant defaultSettings);
-  void        setOption(tTJSVariant options);
-  tTJSVariant getCharacters(int start, int end);
-  void        clear();
-  void        done();
-
-  // property accessor
-  property_accessor(vertical, bool, m_vertical);
+  struct Event {
+    char const *name   = nullptr;
+    int64_t     ts     = 0; // us
+    int64_t     dur    = 0; // us
+    int64_t     length = 0; // 入力テキストの長さ
+    int64_t     glyphs = 0; // 配置済みの文字数
+    int64_t     hits   = 0; // キャッシュのヒット数
+    int64_t     misses = 0; // キャッシュのミス数
+  };
 
-  property_accessor(bold, bool, m_state.bold);
-  property_accessor(italic, bool, m_state.italic);
-  property_accessor_string(face, m_state.face);
-  property_accessor(fontSize, int, m_state.fontSize);
-  property_accessor_cast(chColor, RgbColor, tjs_int, m_state.chColor);
-  property_accessor(rubySize, int, m_state.rubySize);
-  property_accessor(rubyOffset, int, m_state.rubyOffset);
-  property_accessor(shadow, bool, m_state.shadow);
-  property_accessor_cast(shadowColor, RgbColor, tjs_int, m_state.shadowColor);
-  property_accessor(edge, bool, m_state.edge);
-  property_accessor(lineSpacing, int, m_state.lineSpacing);
-  property_accessor(pitch, int, m_state.pitch);
-  property_accessor(lineSize, int, m_state.lineSize);
+  explicit TextRenderProfiler(ttstr const &path)
+      : m_stream(TVPCreateStream(path, TJS_BS_WRITE)),
+        m_origin(std::chrono::steady_clock::now()) {
+    write("{\"traceEvents\":[\n");
+  }
 
-  property_accessor(defaultBold, bool, m_default.bold);
-  property_accessor(defaultItalic, bool, m_default.italic);
-  property_accessor_string(defaultFace, m_default.face);
-  property_accessor(defaultFontSize, int, m_default.fontSize);
-  property_accessor_cast(defaultChColor, RgbColor, tjs_int, m_default.chColor);
-  property_accessor(defaultRubySize, int, m_default.rubySize);
-  property_accessor(defaultRubyOffset, int, m_default.rubyOffset);
-  property_accessor(defaultShadow, bool, m_default.shadow);
-  property_accessor_cast(defaultShadowColor, RgbColor, tjs_int,
-                         m_default.shadowColor);
-  property_accessor(defaultEdge, bool, m_default.edge);
-  property_accessor(defaultLineSpacing, int, m_default.lineSpacing);
-  property_accessor(defaultPitch, int, m_default.pitch);
-  property_accessor(defaultLineSize, int, m_default.lineSize);
+  ~TextRenderProfiler() {
+    // close() されずに破棄された場合．デストラクタからは例外を投げない
+    if (!m_closed) {
+      try {
+        close();
+      } catch (...) {
+      }
+    }
+    delete m_stream;
+  }
 
-private:
-  int m_boxWidth  = 0;
-  int m_boxHeight = 0;
+  int64_t now() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - m_origin)
+        .count();
+  }
 
-  int m_x = 0;
-  int m_y = 0;
+  void push(Event const &event) {
+    // 計測区間の中では書き出さない．一杯なら最も古いものを捨てる
+    if (m_count == kCapacity) {
+      m_head = (m_head + 1) % kCapacity;
+      --m_count;
+      ++m_dropped;
+    }
 
-  int  m_indent            = 0;
-  int  m_autoIndent        = 0;
-  bool m_overflow          = false;
-  bool m_isBeginningOfLine = true;
+    m_events[(m_head + m_count++) % kCapacity] = event;
+  }
 
-  bool m_vertical = false;
+  void drain() {
+    std::string out{};
+    char        line[256];
+
+    for (size_t i = 0; i < m_count; ++i) {
+      auto const &e = m_events[(m_head + i) % kCapacity];
+      std::snprintf(line, sizeof(line),
+                    "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+                    "\"ts\":%lld,\"dur\":%lld,\"args\":{\"length\":%lld,"
+                    "\"glyphs\":%lld,\"hits\":%lld,\"misses\":%lld}}",
+                    m_first ? "" : ",\n", e.name,
+                    static_cast<long long>(e.ts), static_cast<long long>(e.dur),
+                    static_cast<long long>(e.length),
+                    static_cast<long long>(e.glyphs),
+                    static_cast<long long>(e.hits),
+                    static_cast<long long>(e.misses));
+      out += line;
+      m_first = false;
+    }
 
-  TextRenderOptions m_options{};
-  TextRenderState   m_default{};
-  TextRenderState   m_state{};
+    m_head  = 0;
+    m_count = 0;
+    write(out);
+  }
 
-  std::vector<CharacterInfo> m_characters{};
-  std::vector<CharacterInfo> m_buffer{};
-  uint32_t                   m_mode = 0;
+  void close() {
+    m_closed = true;
+    drain();
 
-  void pushCharacter(tjs_char ch);
-  void pushGraphicalCharacter(tjs_string const& graph);
-  void performLinebreak();
-  void flush(bool force = false);
-  void updateFont();
-};
+    char footer[64];
+    std::snprintf(footer, sizeof(footer),
+                  "\n],\"otherData\":{\"dropped\":%llu}}\n",
+                  static_cast<unsigned long long>(m_dropped));
+    write(footer);
+  }
 
-enum TextRenderAlignment {
-  kTextRenderAlignmentLeft   = -1,
-  kTextRenderAlignmentCenter = 0,
-  kTextRenderAlignmentRight  = 1,
+private:
+  static constexpr size_t kCapacity = 1024;
+
+  tTJSBinaryStream                     *m_stream;
+  std::chrono::steady_clock::time_point m_origin;
+  std::array<Event, kCapacity>          m_events{};
+  size_t                                m_head    = 0;
+  size_t                                m_count   = 0;
+  size_t                                m_dropped = 0;
+  bool                                  m_first   = true;
+  bool                                  m_closed  = false;
+
+  void write(std::string const &str) {
+    if (!str.empty()) {
+      m_stream->WriteBuffer(str.data(), static_cast<tjs_uint>(str.size()));
+    }
+  }
 };
 
-// [LEADING] [NORMAL] [FOLLOWING] の形になるように文字をセグメンテーションする．
-
-enum TextRenderMode {
-  kTextRenderModeLeading = 0,
-  kTextRenderModeNormal,
-  kTextRenderModeFollowing,
-};
+// 32-bit FNV-1a
+static uint32_t fnv1a(uint8_t const *data, size_t size,
+                      uint32_t hash = 0x811c9dc5) {
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ data[i]) * 0x01000193;
+  }
+  return hash;
+}
 
-// -------------------------------------------------------------------
+static uint32_t fnv1a(tjs_string const &s) {
+  return fnv1a(reinterpret_cast<uint8_t const *>(s.data()),
+               s.size() * sizeof(tjs_char));
+}
 
-TextRenderBase::TextRenderBase() {}
+static uint32_t load_u32(uint8_t const *p) {
+  return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+         (static_cast<uint32_t>(p[2]) << 16) |
+         (static_cast<uint32_t>(p[3]) << 24);
+}
 
-TextRenderBase::~TextRenderBase() {}
+/* 事前レイアウトファイルの形式 (リトルエンディアン，全て 4 バイト境界)
+ *
+ * ヘッダ (64 バイト)
+ *   magic, version, boxWidth, boxHeight, settingsHash,
+ *   lineCount, lineOffset, styleCount, styleOffset, stateCount, stateOffset,
+ *   glyphCount, glyphOffset, poolLength, poolOffset, reserved
+ * 行の索引 (48 バイト × lineCount, hash の昇順)
+ *   hash, textOffset, textLength, firstGlyph, glyphCount,
+ *   x, y, indent, state, flags | mode << 8 | line << 16, lineHeight,
+ *   pendingCount
+ * 文字の書式 (24 バイト × styleCount)
+ *   faceOffset, faceLength, color, edge, shadow, flags
+ * 行末の書式状態 (56 バイト × stateCount)
+ *   faceOffset, faceLength, flags, fontSize, chColor, rubySize, rubyOffset,
+ *   shadowColor, edgeColor, lineSpacing, pitch, lineSize, reserved × 2
+ * 文字 (32 バイト × glyphCount)
+ *   x, y, cw, size, style, textOffset,
+ *   textLength | (graph | vertical << 1 | line << 2) << 16, source
+ * 文字列 (UTF-16 × poolLength)
+ *
+ * 行の文字は配置済みの glyphCount 文字の後に，禁則処理のため保留中の
+ * pendingCount 文字 (done() していない render() の結果) が続く．
+ *
+ * オフセットは全てファイル先頭からのバイト数，文字列の位置と長さは
+ * 文字列領域内の UTF-16 単位．mmap してそのまま参照できる．
+ */
 
-static bool readchar(tTJSString const &str, size_t &i, tjs_char &c) {
-  auto const len = str.GetLen();
+static constexpr uint32_t kTextRenderLayoutMagic   = 0x594c5254; // "TRLY"
+static constexpr uint32_t kTextRenderLayoutVersion = 4;
 
-  if (++i >= len) {
-    return false;
-  }
+static constexpr size_t kTextRenderLayoutHeaderSize = 64;
+static constexpr size_t kTextRenderLayoutLineSize   = 48;
+static constexpr size_t kTextRenderLayoutStyleSize  = 24;
+static constexpr size_t kTextRenderLayoutStateSize  = 56;
+static constexpr size_t kTextRenderLayoutGlyphSize  = 32;
 
-  c = str[i];
-  return true;
-}
+/**
+ * @brief Read-only view of a precompiled layout file.
+ */
+class TextRenderLayoutFile {
+public:
+  struct Line {
+    size_t   firstGlyph   = 0;
+    size_t   glyphCount   = 0;
+    int      x            = 0;
+    int      y            = 0;
+    int      indent       = 0;
+    size_t   state        = 0;
+    uint32_t flags        = 0;
+    int      lineHeight   = 0;
+    size_t   pendingCount = 0;
+  };
 
-static void read_integer(tTJSString const &str, size_t &i, int &value) {
-  tjs_char ch;
-  bool     is_negative = false;
+  // 行の状態フラグ
+  enum : uint32_t {
+    kOverflow        = 1 << 0,
+    kBeginningOfLine = 1 << 1,
+    kSoftHyphen      = 1 << 2,
+    kModeShift       = 8,
+    kLineShift       = 16,
+  };
 
-  while (true) {
-    if (!readchar(str, i, ch)) {
+  explicit TextRenderLayoutFile(std::vector<uint8_t> data)
+      : m_data(std::move(data)) {
+    if (m_data.size() < kTextRenderLayoutHeaderSize ||
+        header(0) != kTextRenderLayoutMagic ||
+        header(1) != kTextRenderLayoutVersion) {
       TVPThrowExceptionMessage(
-          TJS_W("TextRenderBase::render() failed to "
-                "parse: expected either integer or ';', found EOF"));
+          TJS_W("TextRenderLayoutFile: unsupported layout file"));
     }
 
-    if ('0' <= ch && ch <= '9') {
-      value = value * 10 + (ch - '0');
-      continue;
-    } else if (ch == '-') {
-      is_negative = !is_negative;
-      continue;
-    } else if (ch == ';') {
-      if (is_negative) {
-        value = -value;
+    auto check = [&](size_t offset, size_t count, size_t stride) {
+      if (offset > m_data.size() || count > (m_data.size() - offset) / stride) {
+        TVPThrowExceptionMessage(
+            TJS_W("TextRenderLayoutFile: broken layout file"));
+      }
+    };
+
+    check(header(6), header(5), kTextRenderLayoutLineSize);
+    check(header(8), header(7), kTextRenderLayoutStyleSize);
+    check(header(10), header(9), kTextRenderLayoutStateSize);
+    check(header(12), header(11), kTextRenderLayoutGlyphSize);
+    check(header(14), header(13), sizeof(tjs_char));
+  }
+
+  int      boxWidth() const { return static_cast<int32_t>(header(2)); }
+  int      boxHeight() const { return static_cast<int32_t>(header(3)); }
+  uint32_t settingsHash() const { return header(4); }
+
+  std::optional<Line> find(tjs_string const &text) const {
+    auto const hash  = fnv1a(text);
+    size_t     lo    = 0;
+    size_t     hi    = header(5);
+    auto const lines = m_data.data() + header(6);
+
+    // 索引は hash の昇順に並んでいる
+    while (lo < hi) {
+      auto mid = (lo + hi) / 2;
+      if (load_u32(lines + mid * kTextRenderLayoutLineSize) < hash) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+
+    for (; lo < header(5); ++lo) {
+      auto rec = lines + lo * kTextRenderLayoutLineSize;
+      if (load_u32(rec) != hash) {
+        break;
+      }
+
+      if (string(load_u32(rec + 4), load_u32(rec + 8)) != text) {
+        continue;
+      }
+
+      Line line{
+          .firstGlyph   = load_u32(rec + 12),
+          .glyphCount   = load_u32(rec + 16),
+          .x            = static_cast<int32_t>(load_u32(rec + 20)),
+          .y            = static_cast<int32_t>(load_u32(rec + 24)),
+          .indent       = static_cast<int32_t>(load_u32(rec + 28)),
+          .state        = load_u32(rec + 32),
+          .flags        = load_u32(rec + 36),
+          .lineHeight   = static_cast<int32_t>(load_u32(rec + 40)),
+          .pendingCount = load_u32(rec + 44),
+      };
+
+      if (line.firstGlyph > header(11) ||
+          line.glyphCount > header(11) - line.firstGlyph ||
+          line.pendingCount >
+              header(11) - line.firstGlyph - line.glyphCount ||
+          line.state >= header(9)) {
+        return std::nullopt;
       }
+
+      return line;
+    }
+
+    return std::nullopt;
+  }
+
+  CharacterInfo glyph(size_t index) const {
+    auto rec   = m_data.data() + header(12) + index * kTextRenderLayoutGlyphSize;
+    auto style = load_u32(rec + 16);
+    auto text  = load_u32(rec + 24);
+    auto flags = text >> 16;
+
+    CharacterInfo info{};
+
+    if (style < header(7)) {
+      auto st = m_data.data() + header(8) + style * kTextRenderLayoutStyleSize;
+      auto sf = load_u32(st + 20);
+
+      info.face   = string(load_u32(st), load_u32(st + 4));
+      info.color  = load_u32(st + 8);
+      info.bold   = sf & 1;
+      info.italic = sf & 2;
+      info.edge   = (sf & 4) ? std::make_optional(load_u32(st + 12))
+                             : std::nullopt;
+      info.shadow = (sf & 8) ? std::make_optional(load_u32(st + 16))
+                             : std::nullopt;
+    }
+
+    info.x        = static_cast<int32_t>(load_u32(rec));
+    info.y        = static_cast<int32_t>(load_u32(rec + 4));
+    info.cw       = static_cast<int32_t>(load_u32(rec + 8));
+    info.size     = static_cast<int32_t>(load_u32(rec + 12));
+    info.text     = string(load_u32(rec + 20), text & 0xffff);
+    info.graph    = flags & 1;
+    info.vertical = flags & 2;
+    info.line     = static_cast<int>(flags >> 2);
+    info.source   = load_u32(rec + 28);
+
+    return info;
+  }
+
+  TextRenderState state(size_t index) const {
+    auto rec   = m_data.data() + header(10) + index * kTextRenderLayoutStateSize;
+    auto flags = load_u32(rec + 8);
+
+    TextRenderState st{};
+    st.face        = string(load_u32(rec), load_u32(rec + 4));
+    st.bold        = flags & 1;
+    st.italic      = flags & 2;
+    st.shadow      = flags & 4;
+    st.edge        = flags & 8;
+    st.fontSize    = static_cast<int32_t>(load_u32(rec + 12));
+    st.chColor     = load_u32(rec + 16);
+    st.rubySize    = static_cast<int32_t>(load_u32(rec + 20));
+    st.rubyOffset  = static_cast<int32_t>(load_u32(rec + 24));
+    st.shadowColor = load_u32(rec + 28);
+    st.edgeColor   = load_u32(rec + 32);
+    st.lineSpacing = static_cast<int32_t>(load_u32(rec + 36));
+    st.pitch       = static_cast<int32_t>(load_u32(rec + 40));
+    st.lineSize    = static_cast<int32_t>(load_u32(rec + 44));
+
+    return st;
+  }
+
+private:
+  std::vector<uint8_t> m_data;
+
+  uint32_t header(size_t field) const {
+    return load_u32(m_data.data() + field * 4);
+  }
+
+  tjs_string string(size_t offset, size_t length) const {
+    if (offset > header(13) || length > header(13) - offset) {
+      return tjs_string();
+    }
+
+    auto p = m_data.data() + header(14) + offset * sizeof(tjs_char);
+    tjs_string s(length, 0);
+    for (auto &c : s) {
+      c = static_cast<tjs_char>(p[0] | (p[1] << 8));
+      p += 2;
+    }
+    return s;
+  }
+};
+
+/**
+ * @brief Accumulates laid-out lines and writes a TextRenderLayoutFile.
+ */
+class TextRenderLayoutBuilder {
+public:
+  struct Line {
+    tjs_string                 text{};
+    std::vector<CharacterInfo> glyphs{};
+    std::vector<CharacterInfo> pending{};
+    int                        x      = 0;
+    int                        y      = 0;
+    int                        indent = 0;
+    TextRenderState            state{};
+    uint32_t                   flags      = 0;
+    int                        lineHeight = 0;
+  };
+
+  bool contains(tjs_string const &text) const {
+    return m_texts.find(text) != m_texts.end();
+  }
+
+  void add(Line const &line) {
+    if (!m_texts.emplace(line.text, m_lines.size()).second) {
       return;
     }
 
-    TVPThrowExceptionMessage(
-        TJS_W("TextRenderBase::render() failed to "
-              "parse: expected either integer or ';', found '%1'"),
-        ch);
+    auto state = std::find(m_states.begin(), m_states.end(), line.state);
+    if (state == m_states.end()) {
+      state = m_states.insert(m_states.end(), line.state);
+    }
+
+    LineRecord rec{
+        .hash         = fnv1a(line.text),
+        .text         = intern(line.text),
+        .textLength   = static_cast<uint32_t>(line.text.size()),
+        .firstGlyph   = static_cast<uint32_t>(m_glyphs.size() / 8),
+        .glyphCount   = static_cast<uint32_t>(line.glyphs.size()),
+        .x            = line.x,
+        .y            = line.y,
+        .indent       = line.indent,
+        .state        = static_cast<uint32_t>(state - m_states.begin()),
+        .flags        = line.flags,
+        .lineHeight   = line.lineHeight,
+        .pendingCount = static_cast<uint32_t>(line.pending.size()),
+    };
+
+    auto glyph = [&](CharacterInfo const &ch) {
+      uint32_t flags = (ch.graph ? 1 : 0) | (ch.vertical ? 2 : 0) |
+                       ((static_cast<uint32_t>(ch.line) & 0x3fff) << 2);
+
+      m_glyphs.push_back(static_cast<uint32_t>(ch.x));
+      m_glyphs.push_back(static_cast<uint32_t>(ch.y));
+      m_glyphs.push_back(static_cast<uint32_t>(ch.cw));
+      m_glyphs.push_back(static_cast<uint32_t>(ch.size));
+      m_glyphs.push_back(style(ch));
+      m_glyphs.push_back(intern(ch.text));
+      m_glyphs.push_back(static_cast<uint32_t>(ch.text.size() & 0xffff) |
+                         (flags << 16));
+      m_glyphs.push_back(static_cast<uint32_t>(ch.source));
+    };
+
+    for (auto const &ch : line.glyphs) {
+      glyph(ch);
+    }
+    for (auto const &ch : line.pending) {
+      glyph(ch);
+    }
+
+    m_lines.push_back(rec);
+  }
+
+  void save(ttstr const &path, int boxWidth, int boxHeight,
+            uint32_t settingsHash) {
+    std::sort(m_lines.begin(), m_lines.end(),
+              [](LineRecord const &a, LineRecord const &b) {
+                return a.hash < b.hash;
+              });
+
+    // 文字列領域の大きさを確定させてからヘッダを書く
+    for (auto const &st : m_states) {
+      intern(st.face);
+    }
+
+    auto const lineCount  = m_lines.size();
+    auto const styleCount = m_styles.size() / 6;
+    auto const stateCount = m_states.size();
+    auto const glyphCount = m_glyphs.size() / 8;
+
+    auto const lineOffset  = kTextRenderLayoutHeaderSize;
+    auto const styleOffset = lineOffset + lineCount * kTextRenderLayoutLineSize;
+    auto const stateOffset =
+        styleOffset + styleCount * kTextRenderLayoutStyleSize;
+    auto const glyphOffset =
+        stateOffset + stateCount * kTextRenderLayoutStateSize;
+    auto const poolOffset =
+        glyphOffset + glyphCount * kTextRenderLayoutGlyphSize;
+
+    TextRenderWriter w{};
+
+    for (uint32_t v : {kTextRenderLayoutMagic, kTextRenderLayoutVersion,
+                       static_cast<uint32_t>(boxWidth),
+                       static_cast<uint32_t>(boxHeight), settingsHash,
+                       static_cast<uint32_t>(lineCount),
+                       static_cast<uint32_t>(lineOffset),
+                       static_cast<uint32_t>(styleCount),
+                       static_cast<uint32_t>(styleOffset),
+                       static_cast<uint32_t>(stateCount),
+                       static_cast<uint32_t>(stateOffset),
+                       static_cast<uint32_t>(glyphCount),
+                       static_cast<uint32_t>(glyphOffset),
+                       static_cast<uint32_t>(m_pool.size()),
+                       static_cast<uint32_t>(poolOffset), 0u}) {
+      w.u32(v);
+    }
+
+    for (auto const &line : m_lines) {
+      w.u32(line.hash);
+      w.u32(line.text);
+      w.u32(line.textLength);
+      w.u32(line.firstGlyph);
+      w.u32(line.glyphCount);
+      w.i32(line.x);
+      w.i32(line.y);
+      w.i32(line.indent);
+      w.u32(line.state);
+      w.u32(line.flags);
+      w.i32(line.lineHeight);
+      w.u32(line.pendingCount);
+    }
+
+    for (auto v : m_styles) {
+      w.u32(v);
+    }
+
+    for (auto const &st : m_states) {
+      w.u32(intern(st.face));
+      w.u32(static_cast<uint32_t>(st.face.size()));
+      w.u32((st.bold ? 1 : 0) | (st.italic ? 2 : 0) | (st.shadow ? 4 : 0) |
+            (st.edge ? 8 : 0));
+      w.i32(st.fontSize);
+      w.u32(st.chColor);
+      w.i32(st.rubySize);
+      w.i32(st.rubyOffset);
+      w.u32(st.shadowColor);
+      w.u32(st.edgeColor);
+      w.i32(st.lineSpacing);
+      w.i32(st.pitch);
+      w.i32(st.lineSize);
+      w.u32(0);
+      w.u32(0);
+    }
+
+    for (auto v : m_glyphs) {
+      w.u32(v);
+    }
+
+    for (auto c : m_pool) {
+      w.u16(static_cast<uint16_t>(c));
+    }
+
+    w.save(path);
+  }
+
+  size_t lineCount() const { return m_lines.size(); }
+  size_t glyphCount() const { return m_glyphs.size() / 8; }
+
+private:
+  struct LineRecord {
+    uint32_t hash         = 0;
+    uint32_t text         = 0;
+    uint32_t textLength   = 0;
+    uint32_t firstGlyph   = 0;
+    uint32_t glyphCount   = 0;
+    int32_t  x            = 0;
+    int32_t  y            = 0;
+    int32_t  indent       = 0;
+    uint32_t state        = 0;
+    uint32_t flags        = 0;
+    int32_t  lineHeight   = 0;
+    uint32_t pendingCount = 0;
+  };
+
+  std::vector<LineRecord>                    m_lines{};
+  std::unordered_map<tjs_string, size_t>     m_texts{};
+  std::vector<TextRenderState>               m_states{};
+  std::vector<uint32_t>                      m_styles{}; // 6 words / style
+  std::unordered_map<tjs_string, uint32_t>   m_styleIndex{};
+  std::vector<uint32_t>                      m_glyphs{}; // 8 words / glyph
+  tjs_string                                 m_pool{};
+  std::unordered_map<tjs_string, uint32_t>   m_interned{};
+
+  uint32_t intern(tjs_string const &str) {
+    auto [it, inserted] =
+        m_interned.try_emplace(str, static_cast<uint32_t>(m_pool.size()));
+    if (inserted) {
+      m_pool += str;
+    }
+    return it->second;
+  }
+
+  uint32_t style(CharacterInfo const &ch) {
+    uint32_t flags = (ch.bold ? 1 : 0) | (ch.italic ? 2 : 0) |
+                     (ch.edge ? 4 : 0) | (ch.shadow ? 8 : 0);
+
+    // 書式の組をキーにして共有する
+    tjs_string key = ch.face;
+    for (uint32_t v : {ch.color, ch.edge.value_or(0), ch.shadow.value_or(0),
+                       flags}) {
+      key += static_cast<tjs_char>(v & 0xffff);
+      key += static_cast<tjs_char>(v >> 16);
+    }
+
+    auto [it, inserted] = m_styleIndex.try_emplace(
+        key, static_cast<uint32_t>(m_styles.size() / 6));
+    if (inserted) {
+      m_styles.push_back(intern(ch.face));
+      m_styles.push_back(static_cast<uint32_t>(ch.face.size()));
+      m_styles.push_back(ch.color);
+      m_styles.push_back(ch.edge.value_or(0));
+      m_styles.push_back(ch.shadow.value_or(0));
+      m_styles.push_back(flags);
+    }
+    return it->second;
+  }
+};
+
+#define property_accessor(name, type, storage)                                 \
+  type get_##name() const { return storage; }                                  \
+  void set_##name(type v) { storage = v; }
+
+#define property_accessor_cast(name, type, cast, storage)                      \
+  cast get_##name() const { return cast(storage); }                            \
+  void set_##name(cast v) { storage = type(v); }
+
+#define property_accessor_string(name, storage)                                \
+  tTJSVariant get_##name() const { return tTJSVariant(storage); }              \
+  void        set_##name(tTJSVariant v) {                                      \
+    auto s  = v.AsStringNoAddRef();                                     \
+    storage = s->LongString ? s->LongString : s->ShortString;           \
   }
+
+#define property_delegate(name) NCB_PROPERTY(name, get_##name, set_##name);
+
+class TextRenderGlyphList;
+
+// パースエラー．TJS の文字列を作らないので，ワーカースレッドからも投げられる
+// (TJS の例外へは TextRenderBase::parse() で変換する)
+struct TextRenderParseError {
+  tjs_char const *message;
+  tjs_char        ch;
+  bool            hasChar;
+};
+
+[[noreturn]] static void parse_error(tjs_char const *message) {
+  throw TextRenderParseError{message, 0, false};
 }
 
-bool TextRenderBase::render(tTJSString text, int autoIndent, int diff, int all,
-                            bool same) {
-  // 入力のパース
+[[noreturn]] static void parse_error(tjs_char const *message, tjs_char ch) {
+  throw TextRenderParseError{message, ch, true};
+}
 
-  auto const len = text.GetLen();
+/**
+ * @brief The base of the TextRender class. This only performs the text
+ * layouting and the line breaking (禁則処理)．
+ */
+class TextRenderBase {
+  friend class TextRenderGlyphList;
 
-  for (size_t i = 0; i < len; ++i) {
-    auto ch = text[i];
+public:
+  TextRenderBase();
+  virtual ~TextRenderBase();
+  bool        render(tTJSString text, int autoIndent, int diff, int all,
+                     bool _reserved);
+  bool        append(tTJSString text);
+  void        setRenderSize(int width, int height);
+  void        setDefault(tTJSVariant defaultSettings);
+  void        setOption(tTJSVariant options);
+  tTJSVariant getCharacters(int start, int end);
+  void        clear();
+  void        done();
+  tTJSVariant getDirtyRect();
+  tTJSVariant getDirtyRects();
+  int         hitTest(int x, int y);
+  tTJSVariant glyphRect(int index);
+  void        setEvalCallback(tTJSVariant callback);
+  void        invalidateEval(tTJSVariant name);
+  void        setGraphCallback(tTJSVariant callback);
+  void        invalidateGraph(tTJSVariant name);
+  tTJSVariant paginate(tTJSString text, int autoIndent);
+  void        startTrace(tTJSString path);
+  void        stopTrace();
+  tTJSVariant replayTrace(tTJSString path);
+  tTJSVariant benchmarkLayout(tTJSString text, int iterations);
+  tTJSVariant snapshot();
+  void        setFallback(tTJSVariant face, tTJSVariant faces);
+  tTJSVariant compileLayout(tTJSVariant lines, tTJSString path,
+                            int autoIndent);
+  void        loadLayout(tTJSString path);
+  tTJSVariant checkCorpus(tTJSVariant lines, tTJSVariant sizes, int threads,
+                          int autoIndent);
+  void        startProfile(tTJSString path);
+  void        stopProfile();
+  void        restore(tTJSVariant blob);
+
+  bool get_overflow() const { return m_overflow; }
 
-    switch (ch) {
-    // 制御文字のパース
-    case '%':
-      if (!readchar(text, i, ch)) {
-        TVPThrowExceptionMessage(TJS_W("TextRenderBase::render() failed to "
-                                       "parse: expected character, found EOF"));
+  // property accessor
+  property_accessor(vertical, bool, m_vertical);
+
+  property_accessor(bold, bool, m_state.bold);
+  property_accessor(italic, bool, m_state.italic);
+  property_accessor_string(face, m_state.face);
+  property_accessor(fontSize, int, m_state.fontSize);
+  property_accessor_cast(chColor, RgbColor, tjs_int, m_state.chColor);
+  property_accessor(rubySize, int, m_state.rubySize);
+  property_accessor(rubyOffset, int, m_state.rubyOffset);
+  property_accessor(shadow, bool, m_state.shadow);
+  property_accessor_cast(shadowColor, RgbColor, tjs_int, m_state.shadowColor);
+  property_accessor(edge, bool, m_state.edge);
+  property_accessor(lineSpacing, int, m_state.lineSpacing);
+  property_accessor(pitch, int, m_state.pitch);
+  property_accessor(lineSize, int, m_state.lineSize);
+
+  property_accessor(defaultBold, bool, m_default.bold);
+  property_accessor(defaultItalic, bool, m_default.italic);
+  property_accessor_string(defaultFace, m_default.face);
+  property_accessor(defaultFontSize, int, m_default.fontSize);
+  property_accessor_cast(defaultChColor, RgbColor, tjs_int, m_default.chColor);
+  property_accessor(defaultRubySize, int, m_default.rubySize);
+  property_accessor(defaultRubyOffset, int, m_default.rubyOffset);
+  property_accessor(defaultShadow, bool, m_default.shadow);
+  property_accessor_cast(defaultShadowColor, RgbColor, tjs_int,
+                         m_default.shadowColor);
+  property_accessor(defaultEdge, bool, m_default.edge);
+  property_accessor(defaultLineSpacing, int, m_default.lineSpacing);
+  property_accessor(defaultPitch, int, m_default.pitch);
+  property_accessor(defaultLineSize, int, m_default.lineSize);
+
+  property_accessor(evalCache, bool, m_evalCache);
+  property_accessor(lazyCharacters, bool, m_lazyCharacters);
+
+private:
+  int m_boxWidth  = 0;
+  int m_boxHeight = 0;
+
+  int m_x = 0;
+  int m_y = 0;
+
+  int  m_indent            = 0;
+  int  m_autoIndent        = 0;
+  bool m_overflow          = false;
+  bool m_isBeginningOfLine = true;
+
+  bool m_vertical = false;
+
+  TextRenderOptions m_options{};
+  TextRenderState   m_default{};
+  TextRenderState   m_state{};
+
+  std::vector<CharacterInfo> m_characters{};
+  std::vector<CharacterInfo> m_buffer{};
+  uint32_t                   m_mode        = 0;
+  size_t                     m_provisional = 0; // 末尾の仮配置の文字数
+
+  // 前回の問い合わせ以降に変化した領域
+  static constexpr size_t     kMaxDirtyRects = 4;
+  TextRenderRect              m_bounds{}; // 配置済みの全文字の外接矩形
+  TextRenderRect              m_dirty{};
+  std::vector<TextRenderRect> m_dirtyRects{};
+
+  // 埋め込み ($xxx;) の評価結果
+  tTJSVariant                                m_evalCallback{};
+  bool                                       m_evalCache = false;
+  std::unordered_map<tjs_string, tjs_string> m_evalResults{};
+
+  // グラフィック文字 (&xxx;) の画像サイズ
+  struct GraphMetrics {
+    int width  = 0;
+    int height = 0;
+  };
+
+  tTJSVariant                                  m_graphCallback{};
+  // 画像が無い (コールバックがオブジェクトを返さなかった) 名前は nullopt
+  std::unordered_map<tjs_string, std::optional<GraphMetrics>> m_graphMetrics{};
+
+  std::optional<GraphMetrics> graphMetrics(tjs_string const &graph);
+  void                        resolveEmbeds(tTJSString const &text);
+
+  // clear() 以降に評価できなかった埋め込みや画像があったか
+  bool m_unresolved = false;
+  // ページ分割 (paginate) 用．配置した文字は保持せず数だけ数える
+  struct PageBreak {
+    size_t glyph  = 0;
+    size_t source = 0;
+  };
+
+  bool                   m_paginate         = false;
+  bool                   m_pageBreakPending = false;
+  size_t                 m_glyphCount       = 0;
+  size_t                 m_source           = 0;
+  std::vector<PageBreak> m_pageBreaks{};
+  PageBreak              m_pageLine{};          // 現在の行の先頭の文字
+  int                    m_pageLineNumber = -1; // m_pageLine の行番号
+
+  // レイアウトのトレース (startTrace 〜 stopTrace)
+  std::unique_ptr<TextRenderWriter> m_trace{};
+  ttstr                             m_tracePath{};
+
+  void traceState(uint8_t op);
+  void readTraceState(TextRenderReader &r);
+
+  // 事前レイアウト (compileLayout で生成したファイル) は初回の利用時に読み込む
+  ttstr                                 m_layoutPath{};
+  std::unique_ptr<TextRenderLayoutFile> m_layout{};
+
+  uint32_t settingsHash(int autoIndent) const;
+  bool     renderFromLayout(tTJSString const &text, int autoIndent);
+
+  void inheritSettings(TextRenderBase const &other);
+  // 行ごとの索引 (hitTest 用)．m_characters の先頭から m_indexed 文字分
+  struct LineIndex {
+    int    begin = 0; // 行の範囲 (横書きでは y，縦書きでは x)
+    int    end   = 0;
+    size_t first = 0; // 行の先頭の文字
+    size_t last  = 0; // 行の末尾の次の文字
+  };
+
+  int                    m_line       = 0; // 現在の行番号
+  size_t                 m_lineStart  = 0; // 現在の行の先頭の文字
+  int                    m_lineHeight = 0; // 現在の行の高さ (配置済みの文字)
+  std::vector<LineIndex> m_lineIndex{};
+  size_t                 m_indexed = 0;
+
+  void updateLineIndex();
+  void trimLineIndex();
+
+  void parse(tTJSString const &text);
+  void parseText(tTJSString const &text);
+  void placePending();
+  void retractPending();
+  // 書式ごとの文字幅 (ラスタライザへの問い合わせを減らす)
+  struct Metrics {
+    int ascent       = 0;
+    int space        = 0; // 空白の送り幅 (\w, タブ)
+    int fixedAdvance = 0; // 等幅フォントの送り幅 (等幅でなければ 0)
+    std::unordered_map<Codepoint, int> advances{};
+
+    // 送り幅が fixedAdvance に等しいと測定済みの BMP の文字 (ビット表)．
+    // 等幅とみなすのはプローブの文字だけで判定した推定なので，初めての
+    // 文字は測定して確かめ，異なれば等幅の扱いをやめる
+    std::vector<uint64_t> fixed{};
+
+    bool isFixed(Codepoint ch) const {
+      return ch < 0x10000 && !fixed.empty() &&
+             ((fixed[ch >> 6] >> (ch & 63)) & 1);
+    }
+
+    void markFixed(Codepoint ch) {
+      if (ch < 0x10000) {
+        fixed.resize(0x10000 / 64);
+        fixed[ch >> 6] |= uint64_t(1) << (ch & 63);
       }
+    }
+  };
 
-      switch (ch) {
-      case 'f': // フォントフェイス
-      {
-        tjs_string faceName{};
+  std::unordered_map<tjs_string, Metrics> m_metricsCache{};
+  Metrics                                *m_metrics = nullptr;
+
+  // レイアウト処理の特殊化版 (render() ごとに選択する)．parse は入力の
+  // パースごと，push と flush は制御文字などパースの外からの呼び出し用
+  struct Kernel {
+    size_t (TextRenderBase::*parse)(tTJSString const &, size_t);
+    void (TextRenderBase::*push)(Codepoint);
+    void (TextRenderBase::*flush)(bool);
+  };
+
+  Kernel const *m_kernel        = genericKernel();
+  bool          m_genericKernel = false;
+
+  static Kernel const *kernelFor(bool vertical, bool autoIndent,
+                                 bool monospace);
+  static Kernel const *genericKernel();
+  void                 selectKernel();
+
+  template <int Vertical, int AutoIndent, int Monospace>
+  size_t parseImpl(tTJSString const &text, size_t begin);
+  template <int Vertical, int AutoIndent, int Monospace>
+  void pushCharacterImpl(Codepoint ch);
+  template <int Vertical> void flushImpl(bool force = false);
+
+  void pushCharacter(Codepoint ch) { (this->*m_kernel->push)(ch); }
+  void flush(bool force = false) { (this->*m_kernel->flush)(force); }
+
+  bool m_softHyphen = false; // 直前がソフトハイフン (改行時にハイフンを補う)
+
+  // フォントフォールバック (代替フェイスの並びと文字ごとの解決結果)．
+  // resolved の値は chain 内の要素を指し，元のフェイスのままなら nullptr
+  struct Fallback {
+    std::vector<tjs_string>                          chain{};
+    std::unordered_map<Codepoint, tjs_string const *> resolved{};
+  };
+
+  std::unordered_map<tjs_string, Fallback> m_fallbacks{};
+  Fallback                                *m_fallback = nullptr;
+
+  void              selectFallback();
+  tjs_string const *resolveFace(Codepoint ch);
+  int               fallbackAdvance(tjs_string const &face, Codepoint ch);
+
+  tjs_string styleKey(tjs_string const &face) const;
+  void       markDirty(TextRenderRect const &rect);
+  int        advanceOf(Codepoint ch);
+  int        measureGlyph(Codepoint ch);
+  template <int Vertical, int AutoIndent, int Monospace>
+  void pushWord(tTJSString const &text, size_t begin, size_t end);
+  void pushGraphicalCharacter(tjs_string const &graph);
+  void performLinebreak();
+  int  nextTabStop() const;
+  void skipTo(int x);
+  int  lineHeightOf(CharacterInfo const &ch) const;
+  void placeGlyphs(size_t count);
+  void alignGlyph(CharacterInfo &ch) const;
+  void alignLine();
+  void applyFont() const;
+  void updateFont();
+
+  // 呼び出しごとの計測 (startProfile 〜 stopProfile)
+  std::unique_ptr<TextRenderProfiler> m_profiler{};
+  size_t                              m_cacheHits   = 0;
+  size_t                              m_cacheMisses = 0;
+
+  class ProfileScope {
+  public:
+    ProfileScope(TextRenderBase &self, char const *name, size_t length = 0)
+        : m_self(self) {
+      if (!self.m_profiler) {
+        return;
+      }
+
+      m_event = {
+          .name   = name,
+          .ts     = self.m_profiler->now(),
+          .length = static_cast<int64_t>(length),
+          .hits   = static_cast<int64_t>(self.m_cacheHits),
+          .misses = static_cast<int64_t>(self.m_cacheMisses),
+      };
+    }
+
+    ~ProfileScope() {
+      auto &profiler = m_self.m_profiler;
+      if (!profiler || !m_event.name) {
+        return;
+      }
+
+      m_event.dur    = profiler->now() - m_event.ts;
+      m_event.glyphs = static_cast<int64_t>(m_self.m_characters.size());
+      m_event.hits   = static_cast<int64_t>(m_self.m_cacheHits) - m_event.hits;
+      m_event.misses =
+          static_cast<int64_t>(m_self.m_cacheMisses) - m_event.misses;
+      profiler->push(m_event);
+    }
+
+  private:
+    TextRenderBase            &m_self;
+    TextRenderProfiler::Event m_event{};
+  };
+
+  // 別のインスタンスで配置した後 (例外で抜けた場合も) ラスタライザの書式を
+  // このインスタンスのものに戻す
+  class FontGuard {
+  public:
+    explicit FontGuard(TextRenderBase &self) : m_self(self) {}
+    FontGuard(FontGuard const &) = delete;
+    FontGuard &operator=(FontGuard const &) = delete;
+
+    ~FontGuard() {
+      try {
+        m_self.updateFont();
+      } catch (...) {
+      }
+    }
+
+  private:
+    TextRenderBase &m_self;
+  };
+
+  // 並列処理 (checkCorpus) のワーカーでのみ設定する
+  std::mutex *m_rasterizerLock = nullptr;
+
+  struct CorpusResult {
+    bool    overflow   = false;
+    bool    unchecked  = false; // 埋め込みや未解決の画像を含む
+    bool    error      = false;
+    tjs_int violations = 0;
+    tjs_int glyphs     = 0;
+    double  time       = 0.0;
+
+    std::optional<TextRenderParseError> parseError{};
+  };
+
+  void checkLine(tTJSString const &text, CorpusResult &result);
+
+  // getCharacters() が返した，描画元の文字を参照しているビュー
+  bool                               m_lazyCharacters = false;
+  std::vector<TextRenderGlyphList *> m_views{};
+
+  // 配置済みの文字を変更・破棄する前に呼び，ビューに文字を複製させる
+  void detachViews();
+};
+
+/**
+ * @brief Array-like view of the glyphs of a TextRenderBase, returned by
+ * getCharacters() when lazyCharacters is set. Scripts use it like the array
+ * (chars.count, chars[i].x), but the dictionary of a glyph is created only
+ * when that index is first read.
+ *
+ * Like the array, the view keeps the glyphs of the time getCharacters() was
+ * called. It reads them from the renderer until the renderer is about to
+ * change or discard them, and then copies them (detach()).
+ */
+class TextRenderGlyphList : public tTJSDispatch {
+public:
+  explicit TextRenderGlyphList(TextRenderBase *owner)
+      : m_owner(owner), m_count(owner->m_characters.size()) {
+    m_owner->m_views.push_back(this);
+  }
+
+  ~TextRenderGlyphList() override {
+    if (m_owner) {
+      auto &views = m_owner->m_views;
+      views.erase(std::find(views.begin(), views.end(), this));
+    }
+  }
+
+  tjs_error TJS_INTF_METHOD PropGet(tjs_uint32 flag, const tjs_char *membername,
+                                    tjs_uint32 *hint, tTJSVariant *result,
+                                    iTJSDispatch2 *objthis) override {
+    if (!membername) {
+      return TJS_E_NOTIMPL;
+    }
+
+    if (tjs_string(membername) != TJS_W("count")) {
+      return TJS_E_MEMBERNOTFOUND;
+    }
+
+    if (result) {
+      *result = static_cast<tjs_int>(m_count);
+    }
+    return TJS_S_OK;
+  }
+
+  tjs_error TJS_INTF_METHOD PropGetByNum(tjs_uint32 flag, tjs_int num,
+                                         tTJSVariant   *result,
+                                         iTJSDispatch2 *objthis) override {
+    if (!result) {
+      return TJS_S_OK;
+    }
+
+    // 配列と同じく，範囲外は void
+    if (num < 0 || static_cast<size_t>(num) >= m_count) {
+      *result = tTJSVariant();
+      return TJS_S_OK;
+    }
+
+    auto [it, inserted] = m_items.try_emplace(num);
+    if (inserted) {
+      auto const &glyphs = m_owner ? m_owner->m_characters : m_glyphs;
+      it->second         = glyphs[num].serialize();
+    }
+
+    *result = it->second;
+    return TJS_S_OK;
+  }
+
+  // 描画元の文字を複製し，以降は描画元を参照しない
+  void detach() {
+    auto const &glyphs = m_owner->m_characters;
+    m_glyphs.assign(glyphs.begin(), glyphs.begin() + m_count);
+    m_owner = nullptr;
+  }
+
+private:
+  TextRenderBase            *m_owner;
+  size_t                     m_count;
+  std::vector<CharacterInfo> m_glyphs{}; // detach() 後の文字
+
+  // 作成済みの辞書 (参照された文字の分だけ)
+  std::unordered_map<tjs_int, tTJSVariant> m_items{};
+};
+
+void TextRenderBase::detachViews() {
+  for (auto view : m_views) {
+    view->detach();
+  }
+  m_views.clear();
+}
+
+enum TextRenderAlignment {
+  kTextRenderAlignmentLeft   = -1,
+  kTextRenderAlignmentCenter = 0,
+  kTextRenderAlignmentRight  = 1,
+};
+
+// トレースファイルの形式: マジック，バージョン，以降は呼び出しごとのレコード
+
+static constexpr uint32_t kTextRenderTraceMagic   = 0x52545254; // "TRTR"
+static constexpr uint32_t kTextRenderTraceVersion = 4;
+
+// スナップショットの形式
+static constexpr uint32_t kTextRenderSnapshotMagic   = 0x4e535254; // "TRSN"
+static constexpr uint32_t kTextRenderSnapshotVersion = 5;
+
+enum TextRenderTraceOp : uint8_t {
+  kTextRenderTraceRender = 1,
+  kTextRenderTraceAppend,
+  kTextRenderTraceSetRenderSize,
+  kTextRenderTraceSetDefault,
+  kTextRenderTraceSetOption,
+  kTextRenderTraceClear,
+  kTextRenderTraceDone,
+  kTextRenderTraceCharacters,
+};
+
+// [LEADING] [NORMAL] [FOLLOWING] の形になるように文字をセグメンテーションする．
+
+enum TextRenderMode {
+  kTextRenderModeLeading = 0,
+  kTextRenderModeNormal,
+  kTextRenderModeFollowing,
+  kTextRenderModeWord,  // 欧文の単語の途中
+  kTextRenderModeBreak, // 欧文の空白・ハイフンの直後 (改行可能)
+};
+
+static constexpr tjs_char kSoftHyphen = 0x00AD;
+
+// 単語単位で折り返す文字 (ラテン文字・ギリシャ文字・キリル文字と欧文の約物)
+static bool is_word_char(Codepoint ch) {
+  return ch < 0x2000 || (0x2010 <= ch && ch <= 0x2027);
+}
+
+// 単語の区切り，またはパーサが特別に扱う文字
+static bool is_word_boundary(tjs_char ch) {
+  switch (ch) {
+  case ' ':
+  case '-':
+  case kSoftHyphen:
+  case '%':
+  case '\\':
+  case '[':
+  case '#':
+  case '&':
+  case '$':
+    return true;
+  default:
+    return !is_word_char(ch);
+  }
+}
+
+// -------------------------------------------------------------------
+
+TextRenderRect CharacterInfo::bounds() const {
+  // 縦書きでは送り幅が縦方向になる
+  TextRenderRect rect{
+      .left   = x,
+      .top    = y,
+      .right  = x + (vertical ? size : cw),
+      .bottom = y + (vertical ? cw : size),
+  };
+
+  if (edge) {
+    rect.left -= kTextRenderEdgeExtent;
+    rect.top -= kTextRenderEdgeExtent;
+    rect.right += kTextRenderEdgeExtent;
+    rect.bottom += kTextRenderEdgeExtent;
+  }
+
+  if (shadow) {
+    auto shadowRect = rect;
+    shadowRect.left += kTextRenderShadowOffsetX;
+    shadowRect.top += kTextRenderShadowOffsetY;
+    shadowRect.right += kTextRenderShadowOffsetX;
+    shadowRect.bottom += kTextRenderShadowOffsetY;
+    rect.unite(shadowRect);
+  }
+
+  return rect;
+}
+
+// -------------------------------------------------------------------
+
+TextRenderBase::TextRenderBase() {}
+
+TextRenderBase::~TextRenderBase() {
+  // 残っているビューに文字を引き継ぐ
+  detachViews();
+}
+
+static bool readchar(tTJSString const &str, size_t &i, tjs_char &c) {
+  auto const len = str.GetLen();
+
+  if (++i >= len) {
+    return false;
+  }
+
+  c = str[i];
+  return true;
+}
+
+static void read_integer(tTJSString const &str, size_t &i, int &value) {
+  tjs_char ch;
+  bool     is_negative = false;
+
+  while (true) {
+    if (!readchar(str, i, ch)) {
+      parse_error(
+          TJS_W("TextRenderBase::render() failed to "
+                "parse: expected either integer or ';', found EOF"));
+    }
+
+    if ('0' <= ch && ch <= '9') {
+      value = value * 10 + (ch - '0');
+      continue;
+    } else if (ch == '-') {
+      is_negative = !is_negative;
+      continue;
+    } else if (ch == ';') {
+      if (is_negative) {
+        value = -value;
+      }
+      return;
+    }
+
+    parse_error(
+        TJS_W("TextRenderBase::render() failed to "
+              "parse: expected either integer or ';', found '%1'"),
+        ch);
+  }
+}
+
+bool TextRenderBase::render(tTJSString text, int autoIndent, int diff, int all,
+                            bool same) {
+  ProfileScope scope(*this, "render", text.GetLen());
+
+  if (m_trace) {
+    traceState(kTextRenderTraceRender);
+    m_trace->str(text.c_str());
+    m_trace->i32(autoIndent);
+    m_trace->i32(diff);
+    m_trace->i32(all);
+    m_trace->u8(same);
+  }
+
+  retractPending();
+
+  if (renderFromLayout(text, autoIndent)) {
+    return !m_overflow;
+  }
+
+  if (!m_metrics) {
+    updateFont();
+  }
+
+  m_autoIndent = autoIndent;
+  selectKernel();
+  parse(text);
+
+  return !m_overflow;
+}
+
+bool TextRenderBase::append(tTJSString text) {
+  // 前回の状態 (カーソル・書式・禁則処理中の文字) から続けて配置する．
+  // 保留中の文字は仮配置しておき，次の追加時に改めて行分割する
+  ProfileScope scope(*this, "append", text.GetLen());
+
+  if (m_trace) {
+    traceState(kTextRenderTraceAppend);
+    m_trace->str(text.c_str());
+  }
+
+  retractPending();
+
+  if (!m_metrics) {
+    updateFont();
+  }
+
+  selectKernel();
+  parse(text);
+  placePending();
+
+  return !m_overflow;
+}
+
+static void skip_until(tTJSString const &str, size_t &i, tjs_char term) {
+  tjs_char ch;
+  while (readchar(str, i, ch) && ch != term) {
+  }
+}
+
+void TextRenderBase::resolveEmbeds(tTJSString const &text) {
+  if (!m_evalCache) {
+    m_evalResults.clear();
+  }
+
+  if (m_evalCallback.Type() != tvtObject) {
+    return;
+  }
+
+  // 未解決の変数名を集めて，onEval をまとめて 1 回だけ呼び出す
+  std::vector<tjs_string> names{};
+  size_t const            len = text.GetLen();
+
+  for (size_t i = 0; i < len; ++i) {
+    tjs_char ch = text[i];
+
+    switch (ch) {
+    case '\\':
+      ++i;
+      break;
+    case '%':
+      if (readchar(text, i, ch) && (ch == 'f' || ch == 'D')) {
+        skip_until(text, i, ';');
+      }
+      break;
+    case '[':
+      skip_until(text, i, ']');
+      break;
+    case '&':
+      skip_until(text, i, ';');
+      break;
+    case '$': {
+      tjs_string varName{};
+
+      while (readchar(text, i, ch) && ch != ';') {
+        varName += ch;
+      }
+
+      if (m_evalResults.find(varName) == m_evalResults.end() &&
+          std::find(names.begin(), names.end(), varName) == names.end()) {
+        names.push_back(std::move(varName));
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  if (names.empty()) {
+    return;
+  }
+
+  dbg_print(TVPFormatMessage(TJS_W("evaluate %1 embed(s)"),
+                             static_cast<tjs_int>(names.size())));
+
+  auto array = TJSCreateArrayObject();
+  for (size_t i = 0, cnt = names.size(); i < cnt; ++i) {
+    tTJSVariant name(names[i]);
+    array->PropSetByNum(TJS_MEMBERENSURE, i, &name, array);
+  }
+
+  tTJSVariant  param(array, array);
+  tTJSVariant *params[] = {&param};
+  tTJSVariant  result{};
+  array->Release();
+
+  auto &closure = m_evalCallback.AsObjectClosureNoAddRef();
+  if (TJS_FAILED(closure.FuncCall(0, nullptr, nullptr, &result, 1, params,
+                                  nullptr))) {
+    TVPThrowExceptionMessage(
+        TJS_W("TextRenderBase::render() failed to evaluate embeds"));
+  }
+
+  auto values = result.AsObjectNoAddRef();
+
+  for (size_t i = 0, cnt = names.size(); i < cnt; ++i) {
+    tTJSVariant value{};
+    if (values) {
+      values->PropGetByNum(0, i, &value, values);
+    }
+
+    m_evalResults[names[i]] =
+        value.Type() == tvtVoid ? tjs_string() : tjs_string(ttstr(value).c_str());
+  }
+}
+
+void TextRenderBase::setEvalCallback(tTJSVariant callback) {
+  m_evalCallback = callback;
+  m_evalResults.clear();
+}
+
+void TextRenderBase::invalidateEval(tTJSVariant name) {
+  if (name.Type() == tvtVoid) {
+    m_evalResults.clear();
+    return;
+  }
+
+  m_evalResults.erase(tjs_string(ttstr(name).c_str()));
+}
+
+void TextRenderBase::setGraphCallback(tTJSVariant callback) {
+  m_graphCallback = callback;
+  m_graphMetrics.clear();
+}
+
+void TextRenderBase::invalidateGraph(tTJSVariant name) {
+  if (name.Type() == tvtVoid) {
+    m_graphMetrics.clear();
+    return;
+  }
+
+  m_graphMetrics.erase(tjs_string(ttstr(name).c_str()));
+}
+
+void TextRenderBase::parse(tTJSString const &text) {
+  resolveEmbeds(text);
+
+  try {
+    parseText(text);
+  } catch (TextRenderParseError const &e) {
+    // ワーカーではそのまま呼び出し元 (checkCorpus) へ返す
+    if (m_rasterizerLock) {
+      throw;
+    }
+
+    if (e.hasChar) {
+      TVPThrowExceptionMessage(e.message, e.ch);
+    }
+    TVPThrowExceptionMessage(e.message);
+  }
+}
+
+void TextRenderBase::parseText(tTJSString const &text) {
+  // 特殊化版はパースの開始時に 1 回だけ選ぶ．書式の変更などで選び直された
+  // 場合は，その位置から新しい特殊化版で続ける
+  size_t const len = text.GetLen();
+
+  for (size_t i = 0; i < len;) {
+    i = (this->*m_kernel->parse)(text, i);
+  }
+}
+
+template <int Vertical, int AutoIndent, int Monospace>
+size_t TextRenderBase::parseImpl(tTJSString const &text, size_t begin) {
+  auto const kernel = m_kernel;
+  auto const push   = [this](Codepoint ch) {
+    pushCharacterImpl<Vertical, AutoIndent, Monospace>(ch);
+  };
+
+  // 入力のパース
+
+  size_t const len = text.GetLen();
+
+  for (size_t i = begin; i < len; ++i) {
+    auto ch  = text[i];
+    m_source = i;
+
+    switch (ch) {
+    // 制御文字のパース
+    case '%':
+      if (!readchar(text, i, ch)) {
+        parse_error(TJS_W("TextRenderBase::render() failed to "
+                                       "parse: expected character, found EOF"));
+      }
+
+      switch (ch) {
+      case 'f': // フォントフェイス
+      {
+        tjs_string faceName{};
+
+        while (true) {
+          if (!readchar(text, i, ch)) {
+            parse_error(
+                TJS_W("TextRenderBase::render() failed to "
+                      "parse: expected character, found EOF"));
+          }
+
+          if (ch == ';')
+            break;
+
+          faceName += ch;
+        }
+
+        dbg_print(
+            TVPFormatMessage(TJS_W("change font face name: %1"), faceName));
+
+        m_state.face = faceName;
+        updateFont();
+
+        break;
+      }
+      case 'b': // フォントの装飾
+      {
+        if (!readchar(text, i, ch) && (ch == '0' || ch == '1')) {
+          parse_error(
+              TJS_W("TextRenderBase::render() failed to "
+                    "parse %%b: expected either '0' or '1', found EOF"));
+        }
+        bool flag = ch == '1';
+        if (flag)
+          dbg_print(TJS_W("set bold"));
+        else
+          dbg_print(TJS_W("unset bold"));
+
+        m_state.bold = flag;
+        updateFont();
+
+        break;
+      }
+      case 'i': {
+        if (!readchar(text, i, ch) && (ch == '0' || ch == '1')) {
+          parse_error(
+              TJS_W("TextRenderBase::render() failed to "
+                    "parse %%i: expected either '0' or '1', found EOF"));
+        }
+        bool flag = ch == '1';
+        if (flag)
+          dbg_print(TJS_W("set italic (oblique)"));
+        else
+          dbg_print(TJS_W("unset italic (oblique)"));
+
+        m_state.italic = flag;
+        updateFont();
+
+        break;
+      }
+      case 's': {
+        if (!readchar(text, i, ch) && (ch == '0' || ch == '1')) {
+          parse_error(
+              TJS_W("TextRenderBase::render() failed to "
+                    "parse %%s: expected either '0' or '1', found EOF"));
+        }
+        bool flag = ch == '1';
+        if (flag)
+          dbg_print(TJS_W("set shadow"));
+        else
+          dbg_print(TJS_W("unset shadow"));
+
+        m_state.shadow = flag;
+
+        break;
+      }
+      case 'e': {
+        if (!readchar(text, i, ch) && (ch == '0' || ch == '1')) {
+          parse_error(
+              TJS_W("TextRenderBase::render() failed to "
+                    "parse %%e: expected either '0' or '1', found '%1'"),
+              ch);
+        }
+        bool flag = ch == '1';
+        if (flag)
+          dbg_print(TJS_W("set edge"));
+        else
+          dbg_print(TJS_W("unset edge"));
+
+        m_state.edge = flag;
+
+        break;
+      }
+      case 'B': // TODO: Big
+        dbg_print(TJS_W("big font"));
+        break;
+      case 'S': // TODO: Small
+        dbg_print(TJS_W("small font"));
+        break;
+      case 'r': // Reset
+        dbg_print(TJS_W("reset"));
+        m_state = m_default;
+        updateFont();
+        break;
+      case 'C': // TODO: Centre
+        dbg_print(TJS_W("centre"));
+        break;
+      case 'R': // TODO: Right
+        dbg_print(TJS_W("right"));
+        break;
+      case 'L': // TODO: Left
+        dbg_print(TJS_W("left"));
+        break;
+      case 'p': // ピッチ，%p[0-9]+;
+      {
+        int value = 0;
+        read_integer(text, i, value);
+        m_state.pitch = value;
+        break;
+      }
+      case 'd': // 文字あたり表示時間指定，%d[0-9]+;
+      {
+        int value = 0;
+        read_integer(text, i, value);
+        // TODO: text speed
+        break;
+      }
+      case 'w': // 時間待ち，%w[0-9]+;
+      {
+        int value = 0;
+        read_integer(text, i, value);
+        // TODO: wait
+        break;
+      }
+      case 'D': // %D[0-9]+; || %D$.+;
+      {
+        if (ch == '$') {
+          tjs_string labelName{};
+
+          while (true) {
+            if (!readchar(text, i, ch)) {
+              parse_error(
+                  TJS_W("TextRenderBase::render() failed to "
+                        "parse: expected character, found EOF"));
+            }
+
+            if (ch == ';')
+              break;
+
+            labelName += ch;
+          }
+
+          // TODO: labelName
+
+        } else {
+          int value = 0;
+          read_integer(text, i, value);
+
+          // TODO: label?
+        }
+        //
+        break;
+      }
+      case '0':
+      case '1':
+      case '2':
+      case '3':
+      case '4':
+      case '5':
+      case '6':
+      case '7':
+      case '8':
+      case '9': {
+        int value = static_cast<int>(ch - '0');
+        read_integer(text, i, value);
+
+        // font size
+        m_state.fontSize = m_default.fontSize * value / 100;
+
+        dbg_print(
+            TVPFormatMessage(TJS_W("new font size: %1 px"), m_state.fontSize));
+
+        updateFont();
+
+        break;
+      }
+      default:
+        parse_error(
+            TJS_W("TextRenderBase::render() failed to "
+                  "parse: expected any of 'fbiseBSrCRLpdwD0123456789', found "
+                  "'%1'"),
+            ch);
+        break;
+      }
+      break;
+    case '\\':
+      if (!readchar(text, i, ch)) {
+        parse_error(TJS_W("TextRenderBase::render() failed to "
+                                       "parse: expected character, found EOF"));
+      }
+
+      switch (ch) {
+      case 'n':
+        //　改行
+        flushImpl<Vertical>();
+        performLinebreak();
+        break;
+      case 't':
+        // タブ (次のタブ位置まで進める)．保留中の文字で改行することが
+        // あるので，配置を済ませてから位置を求める
+        flushImpl<Vertical>();
+        skipTo(nextTabStop());
+        break;
+      case 'i':
+        m_indent = m_x;
+        break;
+      case 'r':
+        m_indent = 0;
+        break;
+      case 'w':
+        flushImpl<Vertical>();
+        skipTo(m_x + m_metrics->space + m_state.pitch);
+        break;
+      case 'k':
+        // TODO: キー待ち
+        //
+        break;
+      case 'x':
+        // TODO: nul文字
+        // unknown behaviour: possible UB
+        break;
+      default:
+        goto __draw_normal; // chをふつうの文字列として描画する
+        break;
+      }
+      break;
+    case '[': {
+      // [ .* ]
+      // [ .*, [0-9]+ ]
+      tjs_string ruby{};
+
+      while (true) {
+        if (!readchar(text, i, ch)) {
+          parse_error(
+              TJS_W("TextRenderBase::render() failed to "
+                    "parse: expected character, found EOF"));
+        }
+
+        if (ch == ']')
+          break;
+
+        ruby += ch;
+      }
+
+      // TODO: implement ruby
+
+      break;
+    }
+    case '#': {
+      // [ .* ]
+      // [ .*, [0-9]+ ]
+      RgbColor colour = 0x00;
+
+      while (true) {
+        if (!readchar(text, i, ch)) {
+          parse_error(
+              TJS_W("TextRenderBase::render() failed to "
+                    "parse: expected character, found EOF"));
+        }
+
+        if (ch == ';')
+          break;
+
+        RgbColor c = 0;
+        if ('0' <= ch && ch <= '9') {
+          c = static_cast<RgbColor>(ch - '0');
+        } else if ('A' <= ch && ch <= 'F') {
+          c = 0x0a + static_cast<RgbColor>(ch - 'A');
+        } else if ('a' <= ch && ch <= 'f') {
+          c = 0x0a + static_cast<RgbColor>(ch - 'a');
+        } else {
+          parse_error(
+              TJS_W("TextRenderBase::render() failed to "
+                    "parse: expected hexadecimal number, found '%1'"),
+              ch);
+        }
+
+        colour = (colour << 4) || c;
+      }
+
+      m_state.chColor = colour;
+
+      break;
+    }
+    case '&': {
+      // '&' .+ ';'
+      tjs_string graph{};
+
+      while (true) {
+        if (!readchar(text, i, ch)) {
+          parse_error(
+              TJS_W("TextRenderBase::render() failed to "
+                    "parse: expected character, found EOF"));
+        }
+
+        if (ch == ';')
+          break;
+
+        graph += ch;
+      }
+
+      pushGraphicalCharacter(graph);
+      break;
+    }
+    case '$': {
+      // '&' .+ ';'
+      tjs_string varName{};
+
+      while (true) {
+        if (!readchar(text, i, ch)) {
+          parse_error(
+              TJS_W("TextRenderBase::render() failed to "
+                    "parse: expected character, found EOF"));
+        }
+
+        if (ch == ';')
+          break;
+
+        varName += ch;
+      }
+
+      if (auto it = m_evalResults.find(varName); it != m_evalResults.end()) {
+        auto const &value = it->second;
+        for (size_t k = 0, cnt = value.size(); k < cnt; ++k) {
+          push(decode_codepoint(value.data(), cnt, k));
+        }
+      } else {
+        m_unresolved = true;
+      }
+
+      break;
+    }
+    default:
+      if (m_options.wordWrap && !is_word_boundary(ch)) {
+        // 単語をまとめて配置する
+        auto end = i + 1;
+        while (end < len && !is_word_boundary(text[end])) {
+          ++end;
+        }
+
+        pushWord<Vertical, AutoIndent, Monospace>(text, i, end);
+        i = end - 1;
+        break;
+      }
+
+    __draw_normal:
+      // タダの文字として処理する
+      // TODO: character should include format options;
+      //       as the font is lazy-evaluated/drawn
+      //       (restrictions for line-breaking algorithm)
+      if (is_surrogate(ch)) {
+        push(decode_surrogate(text.c_str(), len, i));
+      } else {
+        push(ch);
+      }
+      break;
+    }
+
+    if (m_kernel != kernel) {
+      return i + 1;
+    }
+  }
+
+  return len;
+}
+
+void TextRenderBase::placePending() {
+  if (m_buffer.empty()) {
+    return;
+  }
+
+  // flush() の結果だけを残し，カーソルと保留バッファは元に戻す
+  auto x                 = m_x;
+  auto y                 = m_y;
+  auto isBeginningOfLine = m_isBeginningOfLine;
+  auto buffer            = m_buffer;
+  auto count             = m_characters.size();
+  auto glyphCount        = m_glyphCount;
+  auto softHyphen        = m_softHyphen;
+  auto line              = m_line;
+  auto lineStart         = m_lineStart;
+  auto lineHeight        = m_lineHeight;
+
+  flush();
+
+  m_provisional       = m_characters.size() - count;
+  m_glyphCount        = glyphCount;
+  m_softHyphen        = softHyphen;
+  m_line              = line;
+  m_lineStart         = lineStart;
+  m_lineHeight        = lineHeight;
+  m_x                 = x;
+  m_y                 = y;
+  m_isBeginningOfLine = isBeginningOfLine;
+  m_buffer            = std::move(buffer);
+}
+
+void TextRenderBase::retractPending() {
+  if (m_provisional == 0) {
+    return;
+  }
+
+  detachViews();
+
+  auto first = m_characters.end() - m_provisional;
+
+  for (auto it = first; it != m_characters.end(); ++it) {
+    markDirty(it->bounds());
+  }
+
+  m_characters.erase(first, m_characters.end());
+  m_provisional = 0;
+
+  // 仮配置で行が高くなっていれば元に戻す
+  alignLine();
+  trimLineIndex();
+}
+
+void TextRenderBase::performLinebreak() {
+  // 空行と次の行の見積もりには現在の書式の高さを使う
+  auto const ascent =
+      m_state.lineSize > 0 ? m_state.lineSize : m_metrics->ascent;
+  auto const blockExtent = m_vertical ? m_boxWidth : m_boxHeight;
+
+  m_x                 = m_indent;
+  m_isBeginningOfLine = true;
+  m_y += (m_lineHeight > 0 ? m_lineHeight : ascent) + m_state.lineSpacing;
+  ++m_line;
+
+  // 行の文字の位置は placeGlyphs() で確定済み
+  m_lineStart  = m_characters.size();
+  m_lineHeight = 0;
+
+  if (m_paginate && blockExtent > 0 && blockExtent < m_y + ascent) {
+    // 次の行が収まらないので改ページする
+    m_y                = 0;
+    m_pageBreakPending = true;
+  }
+}
+
+int TextRenderBase::nextTabStop() const {
+  auto const &stops = m_options.tabStops;
+
+  if (auto it = std::upper_bound(stops.begin(), stops.end(), m_x);
+      it != stops.end()) {
+    return *it;
+  }
+
+  // 指定された位置を過ぎたら一定の幅ごと
+  auto const width =
+      m_options.tabWidth > 0 ? m_options.tabWidth : m_metrics->space * 4;
+  if (width <= 0) {
+    return m_x;
+  }
+
+  auto const origin = stops.empty() ? 0 : stops.back();
+  if (m_x < origin) {
+    return origin;
+  }
+
+  return origin + ((m_x - origin) / width + 1) * width;
+}
+
+void TextRenderBase::skipTo(int x) {
+  // 文字を置かずに送り位置だけを進める．行末を越えた場合は次の文字で改行する．
+  // x は flush() した後の m_x から求めておくこと
+  m_x                 = x;
+  m_mode              = kTextRenderModeNormal;
+  m_isBeginningOfLine = false;
+}
+
+std::optional<TextRenderBase::GraphMetrics>
+TextRenderBase::graphMetrics(tjs_string const &graph) {
+  if (auto it = m_graphMetrics.find(graph); it != m_graphMetrics.end()) {
+    return it->second;
+  }
+
+  if (m_graphCallback.Type() != tvtObject) {
+    m_unresolved = true;
+    return std::nullopt;
+  }
+
+  // 画像サイズは名前ごとに 1 回だけ問い合わせる
+  tTJSVariant  param(graph);
+  tTJSVariant *params[] = {&param};
+  tTJSVariant  result{};
+
+  auto &closure = m_graphCallback.AsObjectClosureNoAddRef();
+  if (TJS_FAILED(closure.FuncCall(0, nullptr, nullptr, &result, 1, params,
+                                  nullptr))) {
+    TVPThrowExceptionMessage(
+        TJS_W("TextRenderBase::render() failed to resolve graphic '%1'"),
+        graph);
+  }
+
+  // 見つからなかった名前も記録し，以降の配置で問い合わせないようにする
+  auto dict = result.AsObjectNoAddRef();
+  if (!dict) {
+    return m_graphMetrics[graph] = std::nullopt;
+  }
+
+  int width  = 0;
+  int height = 0;
+
+  getprop(dict, width);
+  getprop(dict, height);
+
+  return m_graphMetrics[graph] = GraphMetrics{width, height};
+}
+
+void TextRenderBase::pushGraphicalCharacter(tjs_string const &graph) {
+  auto metrics = graphMetrics(graph);
+  if (!metrics) {
+    dbg_print(TVPFormatMessage(TJS_W("unknown graphic: %1"), graph));
+    return;
+  }
+
+  // グラフィック文字は通常の文字として禁則処理する
+  if (m_mode != kTextRenderModeLeading) {
+    flush();
+  }
+
+  // cw は送り方向の大きさなので，縦書きでは画像の高さになる
+  CharacterInfo info{
+      .bold     = m_state.bold,
+      .italic   = m_state.italic,
+      .graph    = true,
+      .vertical = m_vertical,
+      .face     = m_state.face,
+      .x        = 0,
+      .y        = 0,
+      .cw       = m_vertical ? metrics->height : metrics->width,
+      .size     = m_vertical ? metrics->width : metrics->height,
+      .color    = m_state.chColor,
+      .edge =
+          m_state.edge ? std::make_optional(m_state.edgeColor) : (std::nullopt),
+      .shadow = m_state.shadow ? std::make_optional(m_state.shadowColor)
+                               : (std::nullopt),
+      .text   = graph,
+      .source = m_source,
+  };
+
+  m_buffer.push_back(std::move(info));
+
+  m_mode              = kTextRenderModeNormal;
+  m_isBeginningOfLine = false;
+}
+
+// 書字方向などに応じて特殊化したレイアウト処理．
+// テンプレート引数が負の場合は実行時の設定を参照する (汎用版)
+
+template <int Vertical, int AutoIndent, int Monospace>
+void TextRenderBase::pushCharacterImpl(Codepoint ch) {
+  auto charClass = m_options.classOf(ch);
+
+  uint32_t current;
+
+  if (m_options.wordWrap && is_word_char(ch)) {
+    // 欧文は空白・ハイフンの後でのみ改行する
+    if (ch == kSoftHyphen) {
+      bool vertical;
+
+      if constexpr (Vertical < 0) {
+        vertical = m_vertical;
+      } else {
+        vertical = Vertical;
+      }
+
+      // ここまでの文字とハイフンが行に収まる場合のみ改行位置とする．
+      // 収まらなければ単語を続け，手前の改行位置 (前のソフトハイフン
+      // または単語の先頭) で改行させる
+      auto const lineExtent = vertical ? m_boxHeight : m_boxWidth;
+
+      auto x = m_x;
+      for (auto const &pending : m_buffer) {
+        x += pending.cw + m_state.pitch;
+      }
+
+      if (lineExtent < x + advanceOf('-') + m_state.pitch) {
+        return;
+      }
+
+      flushImpl<Vertical>();
+      m_softHyphen = true;
+      m_mode       = kTextRenderModeBreak;
+      return;
+    }
+
+    if (ch == ' ') {
+      current = kTextRenderModeBreak;
+      flushImpl<Vertical>();
+    } else if (ch == '-') {
+      current = kTextRenderModeBreak;
+      if (m_mode != kTextRenderModeWord) {
+        flushImpl<Vertical>();
+      }
+    } else {
+      current = kTextRenderModeWord;
+      if (m_mode != kTextRenderModeWord && m_mode != kTextRenderModeLeading) {
+        flushImpl<Vertical>();
+      }
+    }
+  } else {
+    if (charClass & TextRenderOptions::kLeading) {
+      current = kTextRenderModeLeading;
+    } else if (charClass & TextRenderOptions::kFollowing) {
+      current = kTextRenderModeFollowing;
+    } else {
+      current = kTextRenderModeNormal;
+    }
+
+    if (m_mode != kTextRenderModeLeading) {
+      flushImpl<Vertical>();
+    }
+  }
+
+  tjs_string const *face = &m_state.face;
+  int               advance_width;
+
+  if constexpr (Monospace > 0) {
+    if (m_metrics->isFixed(ch)) {
+      ++m_cacheHits;
+      advance_width = m_metrics->fixedAdvance;
+    } else {
+      advance_width = advanceOf(ch);
+    }
+  } else {
+    tjs_string const *fallback = m_fallback ? resolveFace(ch) : nullptr;
+
+    if (fallback) {
+      face          = fallback;
+      advance_width = fallbackAdvance(*fallback, ch);
+    } else {
+      advance_width = advanceOf(ch);
+    }
+  }
+
+  bool vertical;
+
+  if constexpr (Vertical < 0) {
+    vertical = m_vertical;
+  } else {
+    vertical = Vertical;
+  }
+
+  CharacterInfo info{
+      .bold     = m_state.bold,
+      .italic   = m_state.italic,
+      .graph    = false,
+      .vertical = vertical,
+      .face     = *face,
+      .x        = 0,
+      .y        = 0,
+      .cw       = advance_width,
+      .size     = m_metrics->ascent,
+      .color    = m_state.chColor,
+      .edge =
+          m_state.edge ? std::make_optional(m_state.edgeColor) : (std::nullopt),
+      .shadow = m_state.shadow ? std::make_optional(m_state.shadowColor)
+                               : (std::nullopt),
+      .text   = {},
+      .source = m_source,
+  };
+
+  append_codepoint(info.text, ch);
+  m_buffer.push_back(std::move(info));
+
+  bool autoIndent;
+
+  if constexpr (AutoIndent < 0) {
+    autoIndent = m_autoIndent != 0;
+  } else {
+    autoIndent = AutoIndent;
+  }
+
+  if (autoIndent) {
+    // pre-indent
+    if (m_isBeginningOfLine && m_autoIndent < 0) {
+      m_x -= advance_width;
+    }
+
+    if (charClass & TextRenderOptions::kBegin) {
+      m_indent = m_x + advance_width;
+      // TODO: register pair
+    }
+
+    if ((charClass & TextRenderOptions::kEnd) && m_indent > 0) {
+      flushImpl<Vertical>(); // FIXME: not safe?
+      m_indent = 0;
+    }
+  }
+
+  m_mode              = current;
+  m_isBeginningOfLine = false;
+}
+
+template <int Vertical> void TextRenderBase::flushImpl(bool force) {
+  if (m_buffer.empty()) {
+    return;
+  }
+
+  ProfileScope scope(*this, "flush", m_buffer.size());
+
+  bool vertical;
+
+  if constexpr (Vertical < 0) {
+    vertical = m_vertical;
+  } else {
+    vertical = Vertical;
+  }
+
+  // 縦書きでは m_x を行内の位置，m_y を行の位置として扱う
+  auto const lineExtent = vertical ? m_boxHeight : m_boxWidth;
+
+  // try place all characters in the same line
+  // (行内の位置だけを決め，行方向の位置は placeGlyphs() で行の高さから求める)
+
+  auto x = m_x;
+
+  for (size_t i = 0; i < m_buffer.size(); ++i) {
+    auto advance_width = m_buffer[i].cw;
+    auto new_x         = advance_width + x + m_state.pitch;
+
+    // 単語単位の折り返しでは行末の空白をぶら下げる
+    bool hanging = m_options.wordWrap && m_buffer[i].text.size() == 1 &&
+                   m_buffer[i].text[0] == ' ' && !m_buffer[i].graph;
+
+    if (lineExtent < new_x && !hanging) {
+      if (force) {
+        // ここまでの文字で前の行を確定させる
+        placeGlyphs(i);
+        i = 0;
+
+        performLinebreak();
+        x     = m_x;
+        new_x = advance_width + x + m_state.pitch;
+      } else {
+        if (m_softHyphen) {
+          // ソフトハイフンの位置で改行するのでハイフンを補う
+          auto hyphen = m_buffer.front();
+          hyphen.text = TJS_W("-");
+          hyphen.cw   = advanceOf('-');
+
+          auto rest = std::move(m_buffer);
+          m_buffer  = {std::move(hyphen)};
+          flushImpl<Vertical>(true);
+          m_buffer = std::move(rest);
+        }
+
+        performLinebreak();
+        flushImpl<Vertical>(true);
+        return;
+      }
+    }
+
+    auto &ch = m_buffer[i];
+
+    if (vertical) {
+      ch.y = x;
+    } else {
+      ch.x = x;
+    }
+
+    ch.line = m_line;
+
+    if (m_pageBreakPending) {
+      m_pageBreaks.push_back({.glyph = m_glyphCount + i, .source = ch.source});
+      m_pageBreakPending = false;
+    }
+
+    x = new_x;
+  }
+
+  m_x          = x;
+  m_softHyphen = false;
+
+  placeGlyphs(m_buffer.size());
+}
+
+int TextRenderBase::lineHeightOf(CharacterInfo const &ch) const {
+  // lineSize が指定されていれば行の高さはそれに従う
+  return m_state.lineSize > 0 ? m_state.lineSize : ch.size;
+}
+
+void TextRenderBase::placeGlyphs(size_t count) {
+  auto const blockExtent = m_vertical ? m_boxWidth : m_boxHeight;
+
+  auto first  = m_buffer.begin();
+  auto last   = first + count;
+  auto height = m_lineHeight;
+
+  for (auto it = first; it != last; ++it) {
+    height = std::max(height, lineHeightOf(*it));
+  }
+
+  if (m_paginate) {
+    if (count > 0 && m_pageLineNumber != m_line) {
+      m_pageLine       = {.glyph = m_glyphCount, .source = first->source};
+      m_pageLineNumber = m_line;
+    }
+
+    // 行の高さが確定して収まらなくなったら，行の先頭から次のページに送る
+    if (blockExtent > 0 && m_y > 0 && blockExtent < m_y + height) {
+      m_pageBreaks.push_back(m_pageLine);
+      m_y = 0;
+    }
+
+    // ページ分割では配置結果を保持しない
+    m_glyphCount += count;
+    m_lineHeight = height;
+    m_buffer.erase(first, last);
+    return;
+  }
+
+  m_glyphCount += count;
+
+  if (blockExtent > 0 && blockExtent < m_y + height) {
+    m_overflow = true;
+  }
+
+  // 行が高くなった場合のみ配置済みの文字を並べ直す
+  if (height != m_lineHeight) {
+    m_lineHeight = height;
+    alignLine();
+  }
+
+  for (auto it = first; it != last; ++it) {
+    alignGlyph(*it);
+
+    auto rect = it->bounds();
+    m_bounds.unite(rect);
+    markDirty(rect);
+  }
+
+  m_characters.insert(m_characters.end(), std::make_move_iterator(first),
+                      std::make_move_iterator(last));
+  m_buffer.erase(first, last);
+}
+
+void TextRenderBase::alignGlyph(CharacterInfo &ch) const {
+  // 横書きは下端 (ベースライン) を，縦書きは中心線を揃える
+  if (ch.vertical) {
+    ch.x = m_boxWidth - m_y - (m_lineHeight + ch.size) / 2;
+  } else {
+    ch.y = m_y + m_lineHeight - ch.size;
+  }
+}
+
+void TextRenderBase::alignLine() {
+  detachViews();
+
+  for (auto i = m_lineStart, cnt = m_characters.size(); i < cnt; ++i) {
+    auto &ch  = m_characters[i];
+    auto  old = ch.bounds();
+
+    alignGlyph(ch);
+
+    if (ch.x != old.left || ch.y != old.top) {
+      auto rect = ch.bounds();
+      m_bounds.unite(rect);
+      markDirty(old);
+      markDirty(rect);
+    }
+  }
+}
+
+TextRenderBase::Kernel const *
+TextRenderBase::kernelFor(bool vertical, bool autoIndent, bool monospace) {
+#define kernel(v, a, m)                                                        \
+  Kernel{&TextRenderBase::parseImpl<v, a, m>,                                  \
+         &TextRenderBase::pushCharacterImpl<v, a, m>,                          \
+         &TextRenderBase::flushImpl<v>}
+
+  static Kernel const kernels[] = {
+      kernel(0, 0, 0), kernel(0, 0, 1), kernel(0, 1, 0), kernel(0, 1, 1),
+      kernel(1, 0, 0), kernel(1, 0, 1), kernel(1, 1, 0), kernel(1, 1, 1),
+  };
+#undef kernel
+
+  return &kernels[(vertical << 2) | (autoIndent << 1) | monospace];
+}
+
+TextRenderBase::Kernel const *TextRenderBase::genericKernel() {
+  static Kernel const kernel{
+      &TextRenderBase::parseImpl<-1, -1, -1>,
+      &TextRenderBase::pushCharacterImpl<-1, -1, -1>,
+      &TextRenderBase::flushImpl<-1>,
+  };
+
+  return &kernel;
+}
+
+void TextRenderBase::selectKernel() {
+  if (m_genericKernel || !m_metrics) {
+    m_kernel = genericKernel();
+    return;
+  }
+
+  // 代替フェイスの文字は幅が異なるため等幅の特殊化は使わない
+  m_kernel = kernelFor(m_vertical, m_autoIndent != 0,
+                       m_metrics->fixedAdvance > 0 && !m_fallback);
+}
+
+void TextRenderBase::selectFallback() {
+  auto it    = m_fallbacks.find(m_state.face);
+  m_fallback = (it != m_fallbacks.end() && !it->second.chain.empty())
+                   ? &it->second
+                   : nullptr;
+}
+
+tjs_string const *TextRenderBase::resolveFace(Codepoint ch) {
+  auto fallback = m_fallback;
+
+  if (auto it = fallback->resolved.find(ch); it != fallback->resolved.end()) {
+    return it->second;
+  }
+
+  // 字形の無い文字 (幅 0) は代替フェイスを順に試す．結果はフェイスと
+  // 文字の組ごとに保持するので，ラスタライザへの問い合わせは 1 回で済む
+  tjs_string const *resolved = nullptr;
+
+  auto hasGlyph = [this, ch] { return measureGlyph(ch) > 0; };
+
+  if (ch >= 0x10000) {
+    // BMP 外の文字は字形の有無を確かめられない (measureGlyph() の近似は
+    // 常に幅を返す) ので主フェイスには無いものとし，そのために指定された
+    // 先頭の代替フェイスを使う
+    resolved = &fallback->chain.front();
+  } else if (ch > ' ' && !hasGlyph()) {
+    auto primary = m_state.face;
+
+    for (auto const &candidate : fallback->chain) {
+      m_state.face = candidate;
+      updateFont();
+
+      if (hasGlyph()) {
+        resolved = &candidate;
+        break;
+      }
+    }
+
+    m_state.face = primary;
+    updateFont();
+
+    tjs_string glyph{};
+    append_codepoint(glyph, ch);
+    dbg_print(TVPFormatMessage(TJS_W("fallback for '%1': %2"), glyph,
+                               resolved ? *resolved : primary));
+  }
+
+  fallback->resolved.emplace(ch, resolved);
+  return resolved;
+}
+
+int TextRenderBase::fallbackAdvance(tjs_string const &face, Codepoint ch) {
+  // 代替フェイスの書式の文字幅が分かっていればフォントを切り替えない
+  auto it = m_metricsCache.find(styleKey(face));
+  if (it != m_metricsCache.end()) {
+    auto const &metrics = it->second;
+
+    if (metrics.isFixed(ch)) {
+      ++m_cacheHits;
+      return metrics.fixedAdvance;
+    }
+
+    if (auto adv = metrics.advances.find(ch); adv != metrics.advances.end()) {
+      ++m_cacheHits;
+      return adv->second;
+    }
+  }
+
+  // 代替フェイスに切り替えて測定する
+  auto primary = m_state.face;
+
+  m_state.face = face;
+  updateFont();
+  auto advance_width = advanceOf(ch);
+  m_state.face = primary;
+  updateFont();
+
+  return advance_width;
+}
+
+void TextRenderBase::setFallback(tTJSVariant face, tTJSVariant faces) {
+  auto &fallback = m_fallbacks[tjs_string(ttstr(face).c_str())];
+
+  // "face1,face2,..." の形式で指定する
+  fallback.chain.clear();
+  fallback.resolved.clear();
+
+  tjs_string list = faces.Type() == tvtVoid ? tjs_string()
+                                            : tjs_string(ttstr(faces).c_str());
+  size_t     pos  = 0;
+
+  while (pos <= list.size() && !list.empty()) {
+    auto next = list.find(',', pos);
+    if (next == tjs_string::npos) {
+      next = list.size();
+    }
+
+    if (next > pos) {
+      fallback.chain.push_back(list.substr(pos, next - pos));
+    }
+
+    pos = next + 1;
+  }
+
+  selectFallback();
+  selectKernel();
+}
+
+template <int Vertical, int AutoIndent, int Monospace>
+void TextRenderBase::pushWord(tTJSString const &text, size_t begin,
+                              size_t end) {
+  // 単語の途中では改行しないので，制御文字の判定を省いてまとめて送る．
+  // 文字幅は advanceOf() が文字ごとに保持している
+  auto const str = text.c_str();
+
+  for (auto k = begin; k < end; ++k) {
+    m_source = k;
+    pushCharacterImpl<Vertical, AutoIndent, Monospace>(str[k]);
+  }
+}
+
+int TextRenderBase::advanceOf(Codepoint ch) {
+  if (m_metrics->isFixed(ch)) {
+    ++m_cacheHits;
+    return m_metrics->fixedAdvance;
+  }
+
+  auto it = m_metrics->advances.find(ch);
+  if (it != m_metrics->advances.end()) {
+    ++m_cacheHits;
+    return it->second;
+  }
+
+  ++m_cacheMisses;
+  auto advance_width = measureGlyph(ch);
+
+  m_metrics->advances.emplace(ch, advance_width);
+
+  if (m_metrics->fixedAdvance > 0) {
+    if (advance_width == m_metrics->fixedAdvance) {
+      m_metrics->markFixed(ch);
+    } else {
+      // 等幅ではなかったので，以降は文字ごとの幅を使う
+      m_metrics->fixedAdvance = 0;
+      m_metrics->fixed.clear();
+      selectKernel();
+    }
+  }
+
+  return advance_width;
+}
+
+int TextRenderBase::measureGlyph(Codepoint cp) {
+  int advance_width = 0, advance_height = 0;
+
+  // ラスタライザは UTF-16 の 1 単位しか受け取らないので，BMP 外の文字
+  // (絵文字・CJK 統合漢字拡張 B など) は全角の空白の幅で近似する．
+  // 字形の有無の判定には使えない (resolveFace() を参照)．近似した文字は
+  // CharacterInfo::approximate() で分かる
+  auto ch = cp < 0x10000 ? static_cast<tjs_char>(cp) : tjs_char(0x3000);
+
+  // ラスタライザはプロセスで共有されているので，他のインスタンス (や
+  // ワーカー) が書式を変えている可能性がある．測った幅は書式ごとに
+  // 保持し続けるので，キャッシュに無い文字を測る前に必ず適用し直す
+  std::unique_lock<std::mutex> lock{};
+  if (m_rasterizerLock) {
+    lock = std::unique_lock<std::mutex>(*m_rasterizerLock);
+  }
+
+  applyFont();
+  GetCurrentRasterizer()->GetTextExtent(ch, advance_width, advance_height);
+
+  return advance_width;
+}
+
+tTJSVariant TextRenderBase::benchmarkLayout(tTJSString text, int iterations) {
+  using clock = std::chrono::steady_clock;
+
+  FontGuard guard(*this);
+
+  // 汎用版と特殊化版で同じテキストを配置し，1 文字あたりの時間を比較する
+  auto measure = [&](bool generic) {
+    TextRenderBase bench{};
+    bench.inheritSettings(*this);
+    bench.m_genericKernel = generic;
+    bench.clear();
+
+    clock::duration elapsed{};
+    size_t          glyphs = 0;
+
+    for (int i = 0; i < iterations; ++i) {
+      bench.clear();
+
+      auto start = clock::now();
+      bench.render(text, m_autoIndent, 0, 0, false);
+      bench.done();
+      elapsed += clock::now() - start;
+
+      glyphs += bench.m_glyphCount;
+    }
+
+    auto ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    return glyphs > 0 ? ns / glyphs : 0.0;
+  };
+
+  double generic     = measure(true);
+  double specialised = measure(false);
+  double speedup     = specialised > 0 ? generic / specialised : 0.0;
+
+  auto dict = TJSCreateDictionaryObject();
+
+  setprop(dict, generic);
+  setprop(dict, specialised);
+  setprop(dict, speedup);
+
+  auto res = tTJSVariant(dict, dict);
+  dict->Release();
+
+  return res;
+}
+
+void TextRenderBase::inheritSettings(TextRenderBase const &other) {
+  m_boxWidth      = other.m_boxWidth;
+  m_boxHeight     = other.m_boxHeight;
+  m_vertical      = other.m_vertical;
+  m_options       = other.m_options;
+  m_default       = other.m_default;
+  m_evalCallback  = other.m_evalCallback;
+  m_evalCache     = other.m_evalCache;
+  m_evalResults   = other.m_evalResults;
+  m_graphCallback = other.m_graphCallback;
+  m_graphMetrics  = other.m_graphMetrics;
+
+  // 解決結果は other の chain を指しているので引き継がない
+  for (auto const &[face, fallback] : other.m_fallbacks) {
+    m_fallbacks[face].chain = fallback.chain;
+  }
+}
+
+tTJSVariant TextRenderBase::paginate(tTJSString text, int autoIndent) {
+  FontGuard guard(*this);
+
+  // 現在の表示内容を壊さないよう，別のインスタンスで一度に配置する
+  TextRenderBase pager{};
+  pager.inheritSettings(*this);
+  pager.m_paginate = true;
+  pager.clear();
+
+  pager.m_autoIndent = autoIndent;
+  pager.selectKernel();
+  pager.parse(text);
+  pager.flush();
+
+  auto array = TJSCreateArrayObject();
+
+  for (size_t i = 0, cnt = pager.m_pageBreaks.size(); i < cnt; ++i) {
+    auto const &pageBreak = pager.m_pageBreaks[i];
+    auto        dict      = TJSCreateDictionaryObject();
+
+    tjs_int glyph  = static_cast<tjs_int>(pageBreak.glyph);
+    tjs_int source = static_cast<tjs_int>(pageBreak.source);
+
+    setprop(dict, glyph);
+    setprop(dict, source);
+
+    tTJSVariant v(dict, dict);
+    dict->Release();
+    array->PropSetByNum(TJS_MEMBERENSURE, i, &v, array);
+  }
+
+  auto res = tTJSVariant(array, array);
+  array->Release();
+
+  return res;
+}
+
+void TextRenderBase::startTrace(tTJSString path) {
+  dbg_print(TVPFormatMessage(TJS_W("start trace: %1"), path));
+
+  m_trace     = std::make_unique<TextRenderWriter>();
+  m_tracePath = path;
+
+  m_trace->u32(kTextRenderTraceMagic);
+  m_trace->u32(kTextRenderTraceVersion);
+
+  // 記録開始時点の設定
+  m_trace->u8(kTextRenderTraceSetRenderSize);
+  m_trace->i32(m_boxWidth);
+  m_trace->i32(m_boxHeight);
+  m_trace->u8(kTextRenderTraceSetDefault);
+  m_default.write(*m_trace);
+  m_trace->u8(kTextRenderTraceSetOption);
+  m_options.write(*m_trace);
+}
+
+void TextRenderBase::stopTrace() {
+  if (!m_trace) {
+    return;
+  }
+
+  m_trace->save(m_tracePath);
+  m_trace.reset();
+}
+
+void TextRenderBase::traceState(uint8_t op) {
+  // プロパティ経由の変更も再現できるよう，呼び出し時点の書式を記録する
+  m_trace->u8(op);
+  m_trace->u8(m_vertical);
+  m_default.write(*m_trace);
+  m_state.write(*m_trace);
+}
+
+void TextRenderBase::readTraceState(TextRenderReader &r) {
+  m_vertical = r.u8();
+  m_default.read(r);
+  m_state.read(r);
+  updateFont();
+}
+
+tTJSVariant TextRenderBase::replayTrace(tTJSString path) {
+  static constexpr tjs_int kMaxReportedMismatches = 32;
+
+  auto             data = TextRenderReader::load(path);
+  TextRenderReader r(data.data(), data.size());
+
+  if (r.u32() != kTextRenderTraceMagic || r.u32() != kTextRenderTraceVersion) {
+    TVPThrowExceptionMessage(
+        TJS_W("TextRenderBase::replayTrace() unsupported trace file: %1"),
+        path);
+  }
+
+  FontGuard guard(*this);
+
+  // コールバック類は現在のインスタンスのものを使う
+  TextRenderBase replayer{};
+  replayer.inheritSettings(*this);
+  replayer.clear();
+
+  using clock = std::chrono::steady_clock;
+
+  clock::duration elapsed{};
+  tjs_int         calls      = 0;
+  tjs_int         glyphs     = 0;
+  tjs_int         mismatches = 0;
+
+  auto report = [&](tjs_int index, tjs_char const *what) {
+    if (++mismatches <= kMaxReportedMismatches) {
+      TVPAddLog(TVPFormatMessage(TJS_W("replay: call %1 differs: %2"),
+                                 calls, what));
+      TVPAddLog(TVPFormatMessage(TJS_W("replay:   at glyph %1"), index));
+    }
+  };
+
+  // 計測対象はレイアウト処理のみ
+  auto timed = [&](auto &&fn) {
+    auto count = replayer.m_glyphCount;
+    auto start = clock::now();
+    fn();
+    elapsed += clock::now() - start;
+    if (replayer.m_glyphCount > count) {
+      glyphs += static_cast<tjs_int>(replayer.m_glyphCount - count);
+    }
+  };
+
+  while (!r.eof()) {
+    switch (r.u8()) {
+    case kTextRenderTraceRender: {
+      replayer.readTraceState(r);
+      tTJSString text       = r.str().c_str();
+      auto       autoIndent = r.i32();
+      auto       diff       = r.i32();
+      auto       all        = r.i32();
+      bool       same       = r.u8();
+      timed([&] { replayer.render(text, autoIndent, diff, all, same); });
+      break;
+    }
+    case kTextRenderTraceAppend: {
+      replayer.readTraceState(r);
+      tTJSString text = r.str().c_str();
+      timed([&] { replayer.append(text); });
+      break;
+    }
+    case kTextRenderTraceSetRenderSize: {
+      auto width  = r.i32();
+      auto height = r.i32();
+      timed([&] { replayer.setRenderSize(width, height); });
+      break;
+    }
+    case kTextRenderTraceSetDefault:
+      replayer.m_default.read(r);
+      break;
+    case kTextRenderTraceSetOption:
+      replayer.m_options.read(r);
+      break;
+    case kTextRenderTraceClear:
+      timed([&] { replayer.clear(); });
+      break;
+    case kTextRenderTraceDone:
+      timed([&] { replayer.done(); });
+      break;
+    case kTextRenderTraceCharacters: {
+      auto const &actual = replayer.m_characters;
+      auto        count  = r.u32();
+
+      if (count != actual.size()) {
+        report(static_cast<tjs_int>(std::min<size_t>(count, actual.size())),
+               TJS_W("glyph count"));
+      }
+
+      for (uint32_t i = 0; i < count; ++i) {
+        CharacterInfo expected{};
+        expected.read(r);
+
+        if (i >= actual.size()) {
+          continue;
+        }
+
+        if (auto field = expected.diff(actual[i])) {
+          report(static_cast<tjs_int>(i), field);
+        }
+      }
+      break;
+    }
+    default:
+      TVPThrowExceptionMessage(
+          TJS_W("TextRenderBase::replayTrace() broken trace file: %1"), path);
+    }
+
+    ++calls;
+  }
+
+  auto   dict = TJSCreateDictionaryObject();
+  double time = std::chrono::duration<double, std::milli>(elapsed).count();
+  double glyphsPerSecond = time > 0 ? glyphs * 1000.0 / time : 0.0;
+
+  setprop(dict, calls);
+  setprop(dict, glyphs);
+  setprop(dict, mismatches);
+  setprop(dict, time);
+  setprop(dict, glyphsPerSecond);
+
+  auto res = tTJSVariant(dict, dict);
+  dict->Release();
+
+  return res;
+}
+
+tTJSVariant TextRenderBase::snapshot() {
+  TextRenderWriter w{};
+
+  w.u32(kTextRenderSnapshotMagic);
+  w.u32(kTextRenderSnapshotVersion);
+
+  w.i32(m_boxWidth);
+  w.i32(m_boxHeight);
+  w.i32(m_x);
+  w.i32(m_y);
+  w.i32(m_indent);
+  w.i32(m_autoIndent);
+  w.u8(m_overflow | (m_isBeginningOfLine << 1) | (m_vertical << 2) |
+       (m_softHyphen << 3));
+  w.u32(m_mode);
+  w.u32(static_cast<uint32_t>(m_provisional));
+  w.i32(m_line);
+  w.u32(static_cast<uint32_t>(m_lineStart));
+  w.i32(m_lineHeight);
+  w.u32(static_cast<uint32_t>(m_glyphCount));
+
+  m_options.write(w);
+  m_default.write(w);
+  m_state.write(w);
+
+  w.u32(static_cast<uint32_t>(m_buffer.size()));
+  for (auto const &ch : m_buffer) {
+    ch.write(w);
+  }
+
+  w.u32(static_cast<uint32_t>(m_characters.size()));
+  for (auto const &ch : m_characters) {
+    ch.write(w);
+  }
+
+  auto const &data = w.data();
+  return tTJSVariant(data.data(), static_cast<tjs_uint>(data.size()));
+}
+
+void TextRenderBase::restore(tTJSVariant blob) {
+  auto octet = blob.AsOctetNoAddRef();
+  if (!octet) {
+    TVPThrowExceptionMessage(
+        TJS_W("TextRenderBase::restore() expected an octet snapshot"));
+  }
+
+  TextRenderReader r(octet->GetData(), octet->GetLength());
+
+  if (r.u32() != kTextRenderSnapshotMagic ||
+      r.u32() != kTextRenderSnapshotVersion) {
+    TVPThrowExceptionMessage(
+        TJS_W("TextRenderBase::restore() unsupported snapshot"));
+  }
+
+  // 全て読み込んで検証してから置き換える．壊れたスナップショットでは
+  // 現在の状態を変えない
+  auto boxWidth    = r.i32();
+  auto boxHeight   = r.i32();
+  auto x           = r.i32();
+  auto y           = r.i32();
+  auto indent      = r.i32();
+  auto autoIndent  = r.i32();
+  auto flags       = r.u8();
+  auto mode        = r.u32();
+  auto provisional = static_cast<size_t>(r.u32());
+  auto line        = r.i32();
+  auto lineStart   = static_cast<size_t>(r.u32());
+  auto lineHeight  = r.i32();
+  auto glyphCount  = static_cast<size_t>(r.u32());
+
+  TextRenderOptions options{};
+  TextRenderState   defaultState{};
+  TextRenderState   state{};
+  options.read(r);
+  defaultState.read(r);
+  state.read(r);
+
+  // 文字列は文字ごとに復号する (固定長の記録にはしていない)
+  std::vector<CharacterInfo> buffer(r.count(CharacterInfo::kMinEncodedSize));
+  for (auto &ch : buffer) {
+    ch.read(r);
+  }
+
+  std::vector<CharacterInfo> characters(
+      r.count(CharacterInfo::kMinEncodedSize));
+  TextRenderRect bounds{};
+  for (auto &ch : characters) {
+    ch.read(r);
+    bounds.unite(ch.bounds());
+  }
+
+  if (provisional > characters.size() || lineStart > characters.size()) {
+    TVPThrowExceptionMessage(
+        TJS_W("TextRenderBase::restore() broken snapshot"));
+  }
+
+  // 消える文字の領域を再描画対象にする
+  detachViews();
+  markDirty(m_bounds);
+
+  m_boxWidth          = boxWidth;
+  m_boxHeight         = boxHeight;
+  m_x                 = x;
+  m_y                 = y;
+  m_indent            = indent;
+  m_autoIndent        = autoIndent;
+  m_overflow          = flags & 1;
+  m_isBeginningOfLine = flags & 2;
+  m_vertical          = flags & 4;
+  m_softHyphen        = flags & 8;
+  m_mode              = mode;
+  m_provisional       = provisional;
+  m_line              = line;
+  m_lineStart         = lineStart;
+  m_lineHeight        = lineHeight;
+  m_glyphCount        = glyphCount;
+  m_options           = std::move(options);
+  m_default           = std::move(defaultState);
+  m_state             = std::move(state);
+  m_buffer            = std::move(buffer);
+  m_characters        = std::move(characters);
+  m_bounds            = bounds;
+
+  markDirty(m_bounds);
+
+  m_lineIndex.clear();
+  m_indexed = 0;
+
+  // ラスタライザには触れず，次の render() で書式を適用する
+  m_metrics = nullptr;
+  m_kernel  = genericKernel();
+}
+
+uint32_t TextRenderBase::settingsHash(int autoIndent) const {
+  TextRenderWriter w{};
 
-        while (true) {
-          if (!readchar(text, i, ch)) {
-            TVPThrowExceptionMessage(
-                TJS_W("TextRenderBase::render() failed to "
-                      "parse: expected character, found EOF"));
-          }
+  m_default.write(w);
+  m_options.write(w);
+  w.u8(m_vertical);
+  w.i32(autoIndent);
 
-          if (ch == ';')
-            break;
+  // 代替フェイスの並びも配置結果を変える (順序を固定して書き出す)
+  std::vector<std::pair<tjs_string, std::vector<tjs_string>>> fallbacks{};
+  for (auto const &[face, fallback] : m_fallbacks) {
+    if (!fallback.chain.empty()) {
+      fallbacks.emplace_back(face, fallback.chain);
+    }
+  }
+  std::sort(fallbacks.begin(), fallbacks.end());
 
-          faceName += ch;
-        }
+  for (auto const &[face, chain] : fallbacks) {
+    w.str(face);
+    w.u32(static_cast<uint32_t>(chain.size()));
+    for (auto const &candidate : chain) {
+      w.str(candidate);
+    }
+  }
 
-        dbg_print(
-            TVPFormatMessage(TJS_W("change font face name: %1"), faceName));
+  auto const &data = w.data();
+  return fnv1a(data.data(), data.size());
+}
 
-        m_state.face = faceName;
+tTJSVariant TextRenderBase::compileLayout(tTJSVariant lines, tTJSString path,
+                                          int autoIndent) {
+  auto array = lines.AsObjectNoAddRef();
+  if (!array) {
+    TVPThrowExceptionMessage(
+        TJS_W("TextRenderBase::compileLayout() expected an array of lines"));
+  }
 
-        break;
-      }
-      case 'b': // フォントの装飾
-      {
-        if (!readchar(text, i, ch) && (ch == '0' || ch == '1')) {
-          TVPThrowExceptionMessage(
-              TJS_W("TextRenderBase::render() failed to "
-                    "parse %%b: expected either '0' or '1', found EOF"));
-        }
-        bool flag = ch == '1';
-        if (flag)
-          dbg_print(TJS_W("set bold"));
-        else
-          dbg_print(TJS_W("unset bold"));
+  tTJSVariant countVar{};
+  array->PropGet(0, TJS_W("count"), nullptr, &countVar, array);
+  tjs_int count = countVar;
 
-        m_state.bold = flag;
+  FontGuard guard(*this);
 
-        break;
-      }
-      case 'i': {
-        if (!readchar(text, i, ch) && (ch == '0' || ch == '1')) {
-          TVPThrowExceptionMessage(
-              TJS_W("TextRenderBase::render() failed to "
-                    "parse %%i: expected either '0' or '1', found EOF"));
-        }
-        bool flag = ch == '1';
-        if (flag)
-          dbg_print(TJS_W("set italic (oblique)"));
-        else
-          dbg_print(TJS_W("unset italic (oblique)"));
+  // 埋め込み ($xxx;) は実行時に値が変わるので事前レイアウトの対象外とする
+  TextRenderBase compiler{};
+  compiler.inheritSettings(*this);
+  compiler.m_evalCallback = tTJSVariant();
 
-        m_state.italic = flag;
+  TextRenderLayoutBuilder builder{};
+  tjs_int                 skipped = 0;
 
-        break;
-      }
-      case 's': {
-        if (!readchar(text, i, ch) && (ch == '0' || ch == '1')) {
-          TVPThrowExceptionMessage(
-              TJS_W("TextRenderBase::render() failed to "
-                    "parse %%s: expected either '0' or '1', found EOF"));
-        }
-        bool flag = ch == '1';
-        if (flag)
-          dbg_print(TJS_W("set shadow"));
-        else
-          dbg_print(TJS_W("unset shadow"));
+  for (tjs_int i = 0; i < count; ++i) {
+    tTJSVariant v{};
+    array->PropGetByNum(0, i, &v, array);
 
-        m_state.shadow = flag;
+    tjs_string text = ttstr(v).c_str();
 
-        break;
-      }
-      case 'e': {
-        if (!readchar(text, i, ch) && (ch == '0' || ch == '1')) {
-          TVPThrowExceptionMessage(
-              TJS_W("TextRenderBase::render() failed to "
-                    "parse %%e: expected either '0' or '1', found '%1'"),
-              ch);
-        }
-        bool flag = ch == '1';
-        if (flag)
-          dbg_print(TJS_W("set edge"));
-        else
-          dbg_print(TJS_W("unset edge"));
+    if (text.find('$') != tjs_string::npos || builder.contains(text)) {
+      ++skipped;
+      continue;
+    }
 
-        m_state.edge = flag;
+    // done() はしない．保留中の文字も記録し，通常の render() の直後と同じ
+    // 状態を再現する
+    compiler.clear();
+    compiler.render(text.c_str(), autoIndent, 0, 0, false);
+
+    uint32_t flags =
+        (compiler.m_overflow ? TextRenderLayoutFile::kOverflow : 0u) |
+        (compiler.m_isBeginningOfLine ? TextRenderLayoutFile::kBeginningOfLine
+                                      : 0u) |
+        (compiler.m_softHyphen ? TextRenderLayoutFile::kSoftHyphen : 0u) |
+        (compiler.m_mode << TextRenderLayoutFile::kModeShift) |
+        (static_cast<uint32_t>(compiler.m_line)
+         << TextRenderLayoutFile::kLineShift);
+
+    builder.add({
+        .text       = text,
+        .glyphs     = compiler.m_characters,
+        .pending    = compiler.m_buffer,
+        .x          = compiler.m_x,
+        .y          = compiler.m_y,
+        .indent     = compiler.m_indent,
+        .state      = compiler.m_state,
+        .flags      = flags,
+        .lineHeight = compiler.m_lineHeight,
+    });
+  }
 
-        break;
-      }
-      case 'B': // TODO: Big
-        dbg_print(TJS_W("big font"));
-        break;
-      case 'S': // TODO: Small
-        dbg_print(TJS_W("small font"));
-        break;
-      case 'r': // Reset
-        dbg_print(TJS_W("reset"));
-        m_state = m_default;
-        break;
-      case 'C': // TODO: Centre
-        dbg_print(TJS_W("centre"));
-        break;
-      case 'R': // TODO: Right
-        dbg_print(TJS_W("right"));
-        break;
-      case 'L': // TODO: Left
-        dbg_print(TJS_W("left"));
-        break;
-      case 'p': // ピッチ，%p[0-9]+;
-      {
-        int value = 0;
-        read_integer(text, i, value);
-        m_state.pitch = value;
-        break;
-      }
-      case 'd': // 文字あたり表示時間指定，%d[0-9]+;
-      {
-        int value = 0;
-        read_integer(text, i, value);
-        // TODO: text speed
-        break;
-      }
-      case 'w': // 時間待ち，%w[0-9]+;
-      {
-        int value = 0;
-        read_integer(text, i, value);
-        // TODO: wait
-        break;
-      }
-      case 'D': // %D[0-9]+; || %D$.+;
-      {
-        if (ch == '$') {
-          tjs_string labelName{};
+  builder.save(path, m_boxWidth, m_boxHeight, settingsHash(autoIndent));
 
-          while (true) {
-            if (!readchar(text, i, ch)) {
-              TVPThrowExceptionMessage(
-                  TJS_W("TextRenderBase::render() failed to "
-                        "parse: expected character, found EOF"));
-            }
+  auto dict = TJSCreateDictionaryObject();
 
-            if (ch == ';')
-              break;
+  tjs_int compiled = static_cast<tjs_int>(builder.lineCount());
+  tjs_int glyphs   = static_cast<tjs_int>(builder.glyphCount());
 
-            labelName += ch;
-          }
+  setprop(dict, compiled);
+  setprop(dict, skipped);
+  setprop(dict, glyphs);
 
-          // TODO: labelName
+  auto res = tTJSVariant(dict, dict);
+  dict->Release();
 
-        } else {
-          int value = 0;
-          read_integer(text, i, value);
+  return res;
+}
 
-          // TODO: label?
-        }
-        //
-        break;
-      }
-      case '0':
-      case '1':
-      case '2':
-      case '3':
-      case '4':
-      case '5':
-      case '6':
-      case '7':
-      case '8':
-      case '9': {
-        int value = static_cast<int>(ch - '0');
-        read_integer(text, i, value);
+void TextRenderBase::loadLayout(tTJSString path) {
+  m_layoutPath = path;
+  m_layout.reset();
+}
 
-        // font size
-        m_state.fontSize = m_default.fontSize * value / 100;
+bool TextRenderBase::renderFromLayout(tTJSString const &text, int autoIndent) {
+  if (!m_layout) {
+    if (m_layoutPath.IsEmpty()) {
+      return false;
+    }
 
-        dbg_print(
-            TVPFormatMessage(TJS_W("new font size: %1 px"), m_state.fontSize));
+    // 読み込みに失敗しても繰り返さない．事前レイアウトは省略可能な
+    // キャッシュなので，壊れていれば通常の配置で描画する
+    auto path = m_layoutPath;
+    m_layoutPath = ttstr();
+
+    try {
+      m_layout =
+          std::make_unique<TextRenderLayoutFile>(TextRenderReader::load(path));
+    } catch (...) {
+      TVPAddLog(TVPFormatMessage(
+          TJS_W("TextRenderBase: failed to load layout file, ignored: %1"),
+          path));
+      return false;
+    }
+  }
 
-        updateFont();
+  // clear() 直後の状態からの描画のみ置き換えられる
+  if (!m_characters.empty() || !m_buffer.empty() || m_x != 0 || m_y != 0 ||
+      m_indent != 0 || !(m_state == m_default) ||
+      m_layout->boxWidth() != m_boxWidth ||
+      m_layout->boxHeight() != m_boxHeight ||
+      m_layout->settingsHash() != settingsHash(autoIndent)) {
+    return false;
+  }
 
-        break;
-      }
-      default:
-        TVPThrowExceptionMessage(
-            TJS_W("TextRenderBase::render() failed to "
-                  "parse: expected any of 'fbiseBSrCRLpdwD0123456789', found "
-                  "'%1'"),
-            ch);
-        break;
-      }
-      break;
-    case '\\':
-      if (!readchar(text, i, ch)) {
-        TVPThrowExceptionMessage(TJS_W("TextRenderBase::render() failed to "
-                                       "parse: expected character, found EOF"));
-      }
+  auto line = m_layout->find(text.c_str());
 
-      switch (ch) {
-      case 'n':
-        //　改行
-        flush();
-        performLinebreak();
-        break;
-      case 't':
-        // タブ
-        pushCharacter('\t');
-        break;
-      case 'i':
-        m_indent = m_x;
-        break;
-      case 'r':
-        m_indent = 0;
-        break;
-      case 'w':
-        pushCharacter(' ');
-        break;
-      case 'k':
-        // TODO: キー待ち
-        //
-        break;
-      case 'x':
-        // TODO: nul文字
-        // unknown behaviour: possible UB
-        break;
-      default:
-        goto __draw_normal; // chをふつうの文字列として描画する
-        break;
+  if (!line) {
+    ++m_cacheMisses;
+    return false;
+  }
+
+  std::vector<CharacterInfo> glyphs{};
+  glyphs.reserve(line->glyphCount + line->pendingCount);
+
+  for (size_t i = 0; i < line->glyphCount + line->pendingCount; ++i) {
+    auto ch = m_layout->glyph(line->firstGlyph + i);
+
+    // 画像の大きさは実行中に変わりうるので，現在の値と照合する
+    if (ch.graph) {
+      auto it     = m_graphMetrics.find(ch.text);
+      auto width  = ch.vertical ? ch.size : ch.cw;
+      auto height = ch.vertical ? ch.cw : ch.size;
+      if (it == m_graphMetrics.end() || !it->second ||
+          it->second->width != width || it->second->height != height) {
+        ++m_cacheMisses;
+        return false;
       }
-      break;
-    case '[': {
-      // [ .* ]
-      // [ .*, [0-9]+ ]
-      tjs_string ruby{};
+    }
 
-      while (true) {
-        if (!readchar(text, i, ch)) {
-          TVPThrowExceptionMessage(
-              TJS_W("TextRenderBase::render() failed to "
-                    "parse: expected character, found EOF"));
-        }
+    glyphs.push_back(std::move(ch));
+  }
 
-        if (ch == ']')
-          break;
+  ++m_cacheHits;
 
-        ruby += ch;
-      }
+  // 保留中の文字は未配置のまま戻し，以降の描画で続けて禁則処理する
+  auto pending = glyphs.begin() + line->glyphCount;
+  m_buffer.assign(std::make_move_iterator(pending),
+                  std::make_move_iterator(glyphs.end()));
+  glyphs.erase(pending, glyphs.end());
+  m_characters = std::move(glyphs);
 
-      // TODO: implement ruby
+  for (auto const &ch : m_characters) {
+    auto rect = ch.bounds();
+    m_bounds.unite(rect);
+    markDirty(rect);
+  }
 
-      break;
-    }
-    case '#': {
-      // [ .* ]
-      // [ .*, [0-9]+ ]
-      RgbColor colour = 0x00;
+  m_autoIndent        = autoIndent;
+  m_x                 = line->x;
+  m_y                 = line->y;
+  m_indent            = line->indent;
+  m_state             = m_layout->state(line->state);
+  m_overflow          = line->flags & TextRenderLayoutFile::kOverflow;
+  m_isBeginningOfLine = line->flags & TextRenderLayoutFile::kBeginningOfLine;
+  m_softHyphen        = line->flags & TextRenderLayoutFile::kSoftHyphen;
+  m_mode = (line->flags >> TextRenderLayoutFile::kModeShift) & 0xff;
+  m_line = static_cast<int>(line->flags >> TextRenderLayoutFile::kLineShift);
+  m_lineHeight = line->lineHeight;
+  m_glyphCount += line->glyphCount;
+
+  // 最後の行は以降の描画で並べ直されることがある
+  m_lineStart = m_characters.size();
+  while (m_lineStart > 0 && m_characters[m_lineStart - 1].line == m_line) {
+    --m_lineStart;
+  }
 
-      while (true) {
-        if (!readchar(text, i, ch)) {
-          TVPThrowExceptionMessage(
-              TJS_W("TextRenderBase::render() failed to "
-                    "parse: expected character, found EOF"));
-        }
+  if (!(m_state == m_default)) {
+    // 行末で書式が変わっているので，次の描画時に適用する
+    m_metrics = nullptr;
+    m_kernel  = genericKernel();
+  }
 
-        if (ch == ';')
-          break;
+  return true;
+}
 
-        RgbColor c = 0;
-        if ('0' <= ch && ch <= '9') {
-          c = static_cast<RgbColor>(ch - '0');
-        } else if ('A' <= ch && ch <= 'F') {
-          c = 0x0a + static_cast<RgbColor>(ch - 'A');
-        } else if ('a' <= ch && ch <= 'f') {
-          c = 0x0a + static_cast<RgbColor>(ch - 'a');
-        } else {
-          TVPThrowExceptionMessage(
-              TJS_W("TextRenderBase::render() failed to "
-                    "parse: expected hexadecimal number, found '%1'"),
-              ch);
-        }
+void TextRenderBase::checkLine(tTJSString const &text, CorpusResult &result) {
+  auto start = std::chrono::steady_clock::now();
+
+  // 文字列の参照カウントを他のスレッドと共有しないよう render() を介さない
+  clear();
+  selectKernel();
+  parse(text);
+  done();
+
+  result.time = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+  result.overflow  = m_overflow;
+  result.unchecked = m_unresolved;
+  result.glyphs   = static_cast<tjs_int>(m_characters.size());
+
+  // 行頭の行頭禁則文字・行末の行末禁則文字を数える
+  auto lineOf  = [&](CharacterInfo const &ch) { return ch.line; };
+  auto classOf = [&](CharacterInfo const &ch) -> uint8_t {
+    size_t i = 0;
+    return (ch.graph || ch.text.empty())
+               ? 0
+               : m_options.classOf(
+                     decode_codepoint(ch.text.data(), ch.text.size(), i));
+  };
 
-        colour = (colour << 4) || c;
-      }
+  for (size_t i = 1, cnt = m_characters.size(); i < cnt; ++i) {
+    auto const &prev = m_characters[i - 1];
+    auto const &ch   = m_characters[i];
 
-      m_state.chColor = colour;
+    if (lineOf(prev) == lineOf(ch)) {
+      continue;
+    }
 
-      break;
+    if (classOf(prev) & TextRenderOptions::kLeading) {
+      ++result.violations;
     }
-    case '&': {
-      // '&' .+ ';'
-      tjs_string graph{};
 
-      while (true) {
-        if (!readchar(text, i, ch)) {
-          TVPThrowExceptionMessage(
-              TJS_W("TextRenderBase::render() failed to "
-                    "parse: expected character, found EOF"));
-        }
+    if (classOf(ch) & TextRenderOptions::kFollowing) {
+      ++result.violations;
+    }
+  }
+}
 
-        if (ch == ';')
-          break;
+tTJSVariant TextRenderBase::checkCorpus(tTJSVariant lines, tTJSVariant sizes,
+                                        int threads, int autoIndent) {
+  auto readArray = [](tTJSVariant const &v) {
+    std::vector<tTJSVariant> items{};
 
-        graph += ch;
-      }
+    auto array = v.AsObjectNoAddRef();
+    if (!array) {
+      return items;
+    }
 
-      pushGraphicalCharacter(graph);
-      break;
+    tTJSVariant countVar{};
+    array->PropGet(0, TJS_W("count"), nullptr, &countVar, array);
+    tjs_int count = countVar;
+
+    items.resize(count);
+    for (tjs_int i = 0; i < count; ++i) {
+      array->PropGetByNum(0, i, &items[i], array);
     }
-    case '$': {
-      // '&' .+ ';'
-      tjs_string varName{};
+    return items;
+  };
 
-      while (true) {
-        if (!readchar(text, i, ch)) {
-          TVPThrowExceptionMessage(
-              TJS_W("TextRenderBase::render() failed to "
-                    "parse: expected character, found EOF"));
-        }
+  std::vector<ttstr> texts{};
+  for (auto const &v : readArray(lines)) {
+    texts.push_back(ttstr(v));
+  }
 
-        if (ch == ';')
-          break;
+  // 枠の大きさは [width, height] の配列で指定する．省略時は現在の大きさ
+  std::vector<std::pair<int, int>> boxes{};
+  for (auto const &v : readArray(sizes)) {
+    auto size = v.AsObjectNoAddRef();
+    if (!size) {
+      continue;
+    }
 
-        varName += ch;
-      }
+    tTJSVariant width{}, height{};
+    size->PropGetByNum(0, 0, &width, size);
+    size->PropGetByNum(0, 1, &height, size);
+    boxes.emplace_back(static_cast<tjs_int>(width),
+                       static_cast<tjs_int>(height));
+  }
 
-      // TODO: implement eval
+  if (boxes.empty()) {
+    boxes.emplace_back(m_boxWidth, m_boxHeight);
+  }
 
-      break;
-    }
-    default:
-    __draw_normal:
-      // タダの文字として処理する
-      // TODO: character should include format options;
-      //       as the font is lazy-evaluated/drawn
-      //       (restrictions for line-breaking algorithm)
-      pushCharacter(ch);
-      break;
-    }
+  auto const jobCount = texts.size() * boxes.size();
+
+  if (threads <= 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
   }
+  threads = static_cast<int>(
+      std::min<size_t>(threads, std::max<size_t>(jobCount, 1)));
 
-  return !m_overflow;
-}
+  FontGuard guard(*this);
 
-void TextRenderBase::performLinebreak() {
-  auto rasterizer     = GetCurrentRasterizer();
-  m_x                 = m_indent;
-  m_isBeginningOfLine = true;
-  m_y += rasterizer->GetAscentHeight() + m_state.lineSpacing;
-}
+  // ワーカーごとに独立したインスタンスで配置する．スクリプトの呼び出しは
+  // 他のスレッドから行えないので，埋め込みと未解決の画像を含む行は
+  // unchecked として結果だけを返す (compileLayout() の skipped と同じ扱い)
+  std::mutex rasterizerLock{};
 
-void TextRenderBase::pushGraphicalCharacter(tjs_string const& graph) {
-  // TODO: implement graphical characters
-}
+  struct Worker {
+    TextRenderBase     renderer{};
+    std::mutex         lock{};
+    std::deque<size_t> jobs{};
+  };
 
-void TextRenderBase::pushCharacter(tjs_char ch) {
-  if ((0xD800 <= ch && ch <= 0xDBFF) /* upper surrogate-pair */
-      || (0xDC00 <= ch && ch <= 0xDFFF) /* lower surrogate-pair */) {
-    TVPThrowExceptionMessage(TJS_W("unexpected character: surrogate pair"));
-  }
+  std::vector<std::unique_ptr<Worker>> workers{};
 
-  auto isLeadingChar = m_options.leading.find_first_of(ch) != std::string::npos;
-  auto isFollowingChar =
-      m_options.following.find_first_of(ch) != std::string::npos;
-  auto isIndent     = m_options.begin.find_first_of(ch) != std::string::npos;
-  auto isIndentDecr = m_options.end.find_first_of(ch) != std::string::npos;
+  for (int i = 0; i < threads; ++i) {
+    auto worker = std::make_unique<Worker>();
+    auto &r     = worker->renderer;
 
-  uint32_t current;
+    r.inheritSettings(*this);
+    r.m_evalCallback   = tTJSVariant();
+    r.m_evalResults.clear();
+    r.m_graphCallback  = tTJSVariant();
+    r.m_metricsCache   = m_metricsCache;
+    r.m_metrics        = nullptr;
+    r.m_autoIndent     = autoIndent;
+    r.m_rasterizerLock = &rasterizerLock;
 
-  if (isLeadingChar) {
-    current = kTextRenderModeLeading;
-  } else if (isFollowingChar) {
-    current = kTextRenderModeFollowing;
-  } else {
-    current = kTextRenderModeNormal;
+    workers.push_back(std::move(worker));
   }
 
-  if (m_mode == kTextRenderModeFollowing || m_mode != kTextRenderModeLeading) {
-    flush();
+  // 連続した範囲を各ワーカーに割り当て，空いたワーカーは他から盗む
+  for (size_t job = 0; job < jobCount; ++job) {
+    workers[job * threads / jobCount]->jobs.push_back(job);
   }
 
-  auto rasterizer  = GetCurrentRasterizer();
-  auto text_height = rasterizer->GetAscentHeight();
+  std::vector<CorpusResult> results(jobCount);
 
-  int advance_width = 0, advance_height = 0;
+  auto take = [&](int self, size_t &job) {
+    {
+      auto                       &own = *workers[self];
+      std::lock_guard<std::mutex> lock(own.lock);
+      if (!own.jobs.empty()) {
+        job = own.jobs.back();
+        own.jobs.pop_back();
+        return true;
+      }
+    }
 
-  rasterizer->GetTextExtent(ch, advance_width, advance_height);
+    for (int i = 1; i < threads; ++i) {
+      auto                       &victim = *workers[(self + i) % threads];
+      std::lock_guard<std::mutex> lock(victim.lock);
+      if (!victim.jobs.empty()) {
+        job = victim.jobs.front();
+        victim.jobs.pop_front();
+        return true;
+      }
+    }
 
-  CharacterInfo info{
-      .bold     = m_state.bold,
-      .italic   = m_state.italic,
-      .graph    = false,
-      .vertical = false,
-      .face     = m_state.face,
-      .x        = 0,
-      .y        = 0,
-      .cw       = advance_width,
-      .size     = text_height,
-      .color    = m_state.chColor,
-      .edge =
-          m_state.edge ? std::make_optional(m_state.edgeColor) : (std::nullopt),
-      .shadow = m_state.shadow ? std::make_optional(m_state.shadowColor)
-                               : (std::nullopt),
-      .text = (tjs_string() + ch),
+    return false;
   };
 
-  m_buffer.push_back(std::move(info));
+  auto run = [&](int self) {
+    auto  &renderer = workers[self]->renderer;
+    size_t job;
 
-  if (m_autoIndent) {
-    // pre-indent
-    if (m_isBeginningOfLine && m_autoIndent < 0) {
-      m_x -= advance_width;
-    }
+    while (take(self, job)) {
+      auto const &box    = boxes[job % boxes.size()];
+      auto       &result = results[job];
 
-    if (isIndent) {
-      m_indent = m_x + advance_width;
-      // TODO: register pair
-    }
+      renderer.m_boxWidth  = box.first;
+      renderer.m_boxHeight = box.second;
 
-    if (isIndentDecr && m_indent > 0) {
-      flush(); // FIXME: not safe?
-      m_indent = 0;
+      try {
+        renderer.checkLine(texts[job / boxes.size()], result);
+      } catch (TextRenderParseError const &e) {
+        result.error      = true;
+        result.parseError = e;
+      } catch (...) {
+        result.error = true;
+      }
     }
+  };
+
+  auto start = std::chrono::steady_clock::now();
+
+  std::vector<std::thread> pool{};
+  for (int i = 1; i < threads; ++i) {
+    pool.emplace_back(run, i);
+  }
+  run(0);
+  for (auto &t : pool) {
+    t.join();
   }
 
-  m_mode              = current;
-  m_isBeginningOfLine = false;
-}
+  double elapsed = std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  auto    array          = TJSCreateArrayObject();
+  tjs_int overflowLines  = 0;
+  tjs_int violationLines = 0;
+  tjs_int uncheckedLines = 0;
+  tjs_int errorLines     = 0;
+
+  for (size_t job = 0; job < jobCount; ++job) {
+    auto const &result = results[job];
+    auto        dict   = TJSCreateDictionaryObject();
+
+    tjs_int line       = static_cast<tjs_int>(job / boxes.size());
+    tjs_int width      = boxes[job % boxes.size()].first;
+    tjs_int height     = boxes[job % boxes.size()].second;
+    bool    overflow   = result.overflow;
+    tjs_int violations = result.violations;
+    tjs_int glyphs     = result.glyphs;
+    double  time       = result.time;
+    bool    unchecked  = result.unchecked;
+    bool    error      = result.error;
+
+    // メッセージの組み立ては TJS の文字列を作るのでメインスレッドで行う
+    ttstr message{};
+    if (auto const &e = result.parseError) {
+      message = e->hasChar ? TVPFormatMessage(e->message, e->ch)
+                           : ttstr(e->message);
+    }
 
-void TextRenderBase::flush(bool force) {
-  if (m_buffer.empty()) {
-    return;
+    setprop(dict, line);
+    setprop(dict, width);
+    setprop(dict, height);
+    setprop(dict, overflow);
+    setprop(dict, violations);
+    setprop(dict, glyphs);
+    setprop(dict, time);
+    setprop(dict, unchecked);
+    setprop(dict, error);
+    setprop(dict, message);
+
+    if (unchecked) {
+      uncheckedLines += !error;
+    } else {
+      overflowLines += overflow;
+      violationLines += violations > 0;
+    }
+    errorLines += error;
+
+    tTJSVariant v(dict, dict);
+    dict->Release();
+    array->PropSetByNum(TJS_MEMBERENSURE, static_cast<tjs_int>(job), &v, array);
   }
 
-  // try place all characters in the same line
+  auto        summary = TJSCreateDictionaryObject();
+  tTJSVariant lineResults(array, array);
+  array->Release();
 
-  auto x = m_x;
+  summary->PropSet(TJS_MEMBERENSURE, TJS_W("lines"), nullptr, &lineResults,
+                   summary);
+  setprop(summary, overflowLines);
+  setprop(summary, violationLines);
+  setprop(summary, uncheckedLines);
+  setprop(summary, errorLines);
+  setprop(summary, elapsed);
+  setprop(summary, threads);
 
-  for (auto &ch : m_buffer) {
-    auto advance_width = ch.cw;
-    auto new_x         = advance_width + x + m_state.pitch;
+  auto res = tTJSVariant(summary, summary);
+  summary->Release();
 
-    if (m_boxWidth < new_x) {
-      if (force) {
-        performLinebreak();
-        x     = m_x;
-        new_x = advance_width + x + m_state.pitch;
-      } else {
-        performLinebreak();
-        flush(true);
-        return;
-      }
-    }
+  return res;
+}
 
-    ch.x = x;
-    ch.y = m_y;
+void TextRenderBase::startProfile(tTJSString path) {
+  stopProfile();
+  m_profiler = std::make_unique<TextRenderProfiler>(path);
+}
 
-    x = new_x;
+void TextRenderBase::stopProfile() {
+  if (auto profiler = std::move(m_profiler)) {
+    profiler->close();
   }
-
-  m_x = x;
-  m_characters.insert(m_characters.end(), m_buffer.begin(), m_buffer.end());
-  m_buffer.clear();
 }
 
 void TextRenderBase::setRenderSize(int width, int height) {
+  if (m_trace) {
+    m_trace->u8(kTextRenderTraceSetRenderSize);
+    m_trace->i32(width);
+    m_trace->i32(height);
+  }
+
   m_boxWidth  = width;
   m_boxHeight = height;
 
@@ -977,19 +4169,51 @@ void TextRenderBase::setRenderSize(int width, int height) {
 void TextRenderBase::setDefault(tTJSVariant defaultSettings) {
   dbg_print(TJS_W("set default format"));
   m_default.deserialize(defaultSettings);
+
+  if (m_trace) {
+    m_trace->u8(kTextRenderTraceSetDefault);
+    m_default.write(*m_trace);
+  }
 }
 
 void TextRenderBase::setOption(tTJSVariant options) {
   dbg_print(TJS_W("set option"));
   m_options.deserialize(options);
+
+  if (m_trace) {
+    m_trace->u8(kTextRenderTraceSetOption);
+    m_options.write(*m_trace);
+  }
 }
 
 tTJSVariant TextRenderBase::getCharacters(int start, int end) {
+  ProfileScope scope(*this, "getCharacters");
+
   // TODO: only (0, 0) is observed
-  auto array = TJSCreateArrayObject();
   dbg_print(TVPFormatMessage(TJS_W("get characters: [%1, %2]"), start, end));
 
-  if ((end < start) || (start == 0 && end == 0)) {
+  bool const all = (end < start) || (start == 0 && end == 0);
+
+  if (all && m_trace) {
+    m_trace->u8(kTextRenderTraceCharacters);
+    m_trace->u32(static_cast<uint32_t>(m_characters.size()));
+    for (auto const &ch : m_characters) {
+      ch.write(*m_trace);
+    }
+  }
+
+  if (all && m_lazyCharacters) {
+    // 辞書は参照された文字の分だけ作る
+    auto list = new TextRenderGlyphList(this);
+    auto res  = tTJSVariant(list, list);
+    list->Release();
+
+    return res;
+  }
+
+  auto array = TJSCreateArrayObject();
+
+  if (all) {
     for (size_t i = 0, cnt = m_characters.size(); i < cnt; ++i) {
       auto ch = m_characters[i].serialize();
       array->PropSetByNum(TJS_MEMBERENSURE, i, &ch, array);
@@ -1004,7 +4228,27 @@ tTJSVariant TextRenderBase::getCharacters(int start, int end) {
 void TextRenderBase::clear() {
   dbg_print(TJS_W("clear character buffer and format"));
 
+  if (m_trace) {
+    m_trace->u8(kTextRenderTraceClear);
+  }
+
+  detachViews();
   m_characters.clear();
+  m_buffer.clear();
+  m_provisional = 0;
+  m_glyphCount  = 0;
+  m_softHyphen  = false;
+  m_unresolved  = false;
+  m_line        = 0;
+  m_lineStart   = 0;
+  m_lineHeight  = 0;
+
+  m_lineIndex.clear();
+  m_indexed = 0;
+
+  // 消去された文字の領域も再描画が必要
+  markDirty(m_bounds);
+  m_bounds = {};
 
   m_state    = m_default;
   m_overflow = false;
@@ -1020,23 +4264,273 @@ void TextRenderBase::clear() {
   updateFont();
 }
 
-void TextRenderBase::updateFont() {
+void TextRenderBase::updateLineIndex() {
+  // 現在の行は高さが変わると並べ直されるので索引し直す
+  if (m_indexed > m_lineStart) {
+    while (!m_lineIndex.empty() && m_lineIndex.back().first >= m_lineStart) {
+      m_lineIndex.pop_back();
+    }
+    m_indexed = m_lineIndex.empty() ? 0 : m_lineIndex.back().last;
+  }
+
+  // 前回以降に追加された文字だけを索引に加える
+  for (auto cnt = m_characters.size(); m_indexed < cnt; ++m_indexed) {
+    auto const &ch = m_characters[m_indexed];
+
+    int begin = m_vertical ? ch.x : ch.y;
+    int end   = begin + ch.size;
+
+    if (m_lineIndex.empty() ||
+        m_characters[m_lineIndex.back().first].line != ch.line) {
+      m_lineIndex.push_back({begin, end, m_indexed, m_indexed + 1});
+      continue;
+    }
+
+    auto &line = m_lineIndex.back();
+    line.begin = std::min(line.begin, begin);
+    line.end   = std::max(line.end, end);
+    line.last  = m_indexed + 1;
+  }
+}
+
+void TextRenderBase::trimLineIndex() {
+  auto const cnt = m_characters.size();
+
+  if (m_indexed <= cnt) {
+    return;
+  }
+
+  // 取り除かれた文字を含む行は索引し直す
+  while (!m_lineIndex.empty() && m_lineIndex.back().last > cnt) {
+    m_lineIndex.pop_back();
+  }
+
+  m_indexed = m_lineIndex.empty() ? 0 : m_lineIndex.back().last;
+}
+
+int TextRenderBase::hitTest(int x, int y) {
+  updateLineIndex();
+
+  auto const block = m_vertical ? x : y;
+  auto const pos   = m_vertical ? y : x;
+
+  // 行は書字方向に並んでいる (縦書きでは右から左)
+  auto line = std::partition_point(
+      m_lineIndex.begin(), m_lineIndex.end(), [&](LineIndex const &l) {
+        return m_vertical ? block < l.begin : l.end <= block;
+      });
+
+  if (line == m_lineIndex.end() || block < line->begin || line->end <= block) {
+    return -1;
+  }
+
+  // 行内の文字は送り方向に並んでいる
+  auto first = m_characters.begin() + line->first;
+  auto last  = m_characters.begin() + line->last;
+  auto glyph =
+      std::partition_point(first, last, [&](CharacterInfo const &ch) {
+        return (m_vertical ? ch.y : ch.x) + ch.cw <= pos;
+      });
+
+  if (glyph == last || pos < (m_vertical ? glyph->y : glyph->x)) {
+    return -1;
+  }
+
+  return static_cast<int>(glyph - m_characters.begin());
+}
+
+tTJSVariant TextRenderBase::glyphRect(int index) {
+  if (index < 0 || static_cast<size_t>(index) >= m_characters.size()) {
+    return tTJSVariant();
+  }
+
+  auto const &ch = m_characters[index];
+
+  TextRenderRect rect{
+      .left   = ch.x,
+      .top    = ch.y,
+      .right  = ch.x + (ch.vertical ? ch.size : ch.cw),
+      .bottom = ch.y + (ch.vertical ? ch.cw : ch.size),
+  };
+
+  return rect.serialize();
+}
+
+void TextRenderBase::markDirty(TextRenderRect const &rect) {
+  if (rect.empty()) {
+    return;
+  }
+
+  m_dirty.unite(rect);
+
+  // 重なる矩形があれば結合する
+  for (auto &r : m_dirtyRects) {
+    if (rect.left <= r.right && r.left <= rect.right && rect.top <= r.bottom &&
+        r.top <= rect.bottom) {
+      r.unite(rect);
+      return;
+    }
+  }
+
+  if (m_dirtyRects.size() < kMaxDirtyRects) {
+    m_dirtyRects.push_back(rect);
+    return;
+  }
+
+  // 上限に達したら面積の増加が最小となる矩形に結合する
+  auto    best     = m_dirtyRects.begin();
+  int64_t bestCost = INT64_MAX;
+
+  for (auto it = m_dirtyRects.begin(); it != m_dirtyRects.end(); ++it) {
+    auto merged = *it;
+    merged.unite(rect);
+    auto cost = merged.area() - it->area();
+    if (cost < bestCost) {
+      best     = it;
+      bestCost = cost;
+    }
+  }
+
+  best->unite(rect);
+}
+
+tTJSVariant TextRenderBase::getDirtyRect() {
+  tTJSVariant res{};
+
+  if (!m_dirty.empty()) {
+    res = m_dirty.serialize();
+  }
+
+  m_dirty = {};
+  m_dirtyRects.clear();
+
+  return res;
+}
+
+tTJSVariant TextRenderBase::getDirtyRects() {
+  auto array = TJSCreateArrayObject();
+
+  for (size_t i = 0, cnt = m_dirtyRects.size(); i < cnt; ++i) {
+    auto rect = m_dirtyRects[i].serialize();
+    array->PropSetByNum(TJS_MEMBERENSURE, i, &rect, array);
+  }
+
+  m_dirty = {};
+  m_dirtyRects.clear();
+
+  auto res = tTJSVariant(array, array);
+  array->Release();
+
+  return res;
+}
+
+tjs_string TextRenderBase::styleKey(tjs_string const &face) const {
+  tjs_string key = face;
+  key += static_cast<tjs_char>(0);
+  key += static_cast<tjs_char>(m_state.fontSize);
+  key += static_cast<tjs_char>(m_state.bold | (m_state.italic << 1));
+  return key;
+}
+
+void TextRenderBase::applyFont() const {
   auto rasterizer = GetCurrentRasterizer();
   auto font       = tTVPFont{
       .Height = m_state.fontSize, // height of text
       .Flags  = static_cast<tjs_uint32>((m_state.bold ? TVP_TF_BOLD : 0) |
                                        (m_state.italic ? TVP_TF_ITALIC : 0)),
       .Angle  = 0,
-      .Face   = m_state.face, // TODO: this may fuck up the font settings by
-                              // forcing the fallback font (in most cases)
+      .Face   = m_state.face, // NOTE: glyphs missing from this face are
+                              // resolved per character by resolveFace()
   };
 
   rasterizer->ApplyFont(font);
 }
 
+void TextRenderBase::updateFont() {
+  ProfileScope scope(*this, "updateFont");
+
+  auto key = styleKey(m_state.face);
+
+  // ワーカーは書式が既知ならラスタライザに触れない．キャッシュに無い文字は
+  // measureGlyph() がロックを取って書式を適用し直してから測る
+  if (m_rasterizerLock) {
+    if (auto it = m_metricsCache.find(key); it != m_metricsCache.end()) {
+      m_metrics = &it->second;
+      ++m_cacheHits;
+
+      selectFallback();
+      selectKernel();
+      return;
+    }
+  }
+
+  // 並列処理中はラスタライザを排他的に使う
+  std::unique_lock<std::mutex> lock{};
+  if (m_rasterizerLock) {
+    lock = std::unique_lock<std::mutex>(*m_rasterizerLock);
+  }
+
+  applyFont();
+
+  auto [it, inserted] = m_metricsCache.try_emplace(std::move(key));
+  m_metrics           = &it->second;
+  ++(inserted ? m_cacheMisses : m_cacheHits);
+
+  if (inserted) {
+    auto rasterizer   = GetCurrentRasterizer();
+    m_metrics->ascent = rasterizer->GetAscentHeight();
+
+    // 字形の異なる文字の幅が全て等しければ等幅フォントとみなす
+    static constexpr tjs_char probes[] = {'i', 'W', '.', 0x3042 /* あ */};
+
+    int fixedAdvance = -1;
+    for (auto probe : probes) {
+      int advance = 0, height = 0;
+      rasterizer->GetTextExtent(probe, advance, height);
+      m_metrics->advances.emplace(probe, advance);
+
+      fixedAdvance = (fixedAdvance < 0 || fixedAdvance == advance) ? advance : 0;
+    }
+    m_metrics->fixedAdvance = fixedAdvance;
+
+    if (fixedAdvance > 0) {
+      for (auto probe : probes) {
+        m_metrics->markFixed(probe);
+      }
+    }
+
+    int space = 0, height = 0;
+    rasterizer->GetTextExtent(' ', space, height);
+    m_metrics->space = space;
+  }
+
+  selectFallback();
+  selectKernel();
+}
+
 void TextRenderBase::done() {
   dbg_print(TJS_W("flush character buffer"));
-  flush();
+
+  {
+    ProfileScope scope(*this, "done");
+
+    if (m_trace) {
+      m_trace->u8(kTextRenderTraceDone);
+    }
+
+    retractPending();
+
+    if (!m_metrics && !m_buffer.empty()) {
+      updateFont();
+    }
+
+    flush();
+  }
+
+  // 計測区間を閉じてから書き出す
+  if (m_profiler) {
+    m_profiler->drain();
+  }
 }
 
 // register the class
@@ -1044,12 +4538,34 @@ NCB_REGISTER_CLASS(TextRenderBase) {
   Constructor();
 
   NCB_METHOD(render);
+  NCB_METHOD(append);
   NCB_METHOD(setRenderSize);
   NCB_METHOD(setDefault);
   NCB_METHOD(setOption);
   NCB_METHOD(getCharacters);
   NCB_METHOD(clear);
   NCB_METHOD(done);
+  NCB_METHOD(getDirtyRect);
+  NCB_METHOD(getDirtyRects);
+  NCB_METHOD(hitTest);
+  NCB_METHOD(glyphRect);
+  NCB_METHOD(setEvalCallback);
+  NCB_METHOD(invalidateEval);
+  NCB_METHOD(setGraphCallback);
+  NCB_METHOD(invalidateGraph);
+  NCB_METHOD(paginate);
+  NCB_METHOD(startTrace);
+  NCB_METHOD(stopTrace);
+  NCB_METHOD(replayTrace);
+  NCB_METHOD(benchmarkLayout);
+  NCB_METHOD(snapshot);
+  NCB_METHOD(setFallback);
+  NCB_METHOD(compileLayout);
+  NCB_METHOD(loadLayout);
+  NCB_METHOD(checkCorpus);
+  NCB_METHOD(startProfile);
+  NCB_METHOD(stopProfile);
+  NCB_METHOD(restore);
 
   property_delegate(vertical);
   property_delegate(bold);
@@ -1079,4 +4595,8 @@ NCB_REGISTER_CLASS(TextRenderBase) {
   property_delegate(defaultLineSpacing);
   property_delegate(defaultPitch);
   property_delegate(defaultLineSize);
+
+  property_delegate(evalCache);
+  property_delegate(lazyCharacters);
+  NCB_PROPERTY_RO(overflow, get_overflow);
 };